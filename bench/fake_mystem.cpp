@@ -0,0 +1,80 @@
+// Fake mystem for benchmarks: reads documents from stdin and answers in the `mystem -cd --format json` format,
+// or in the plain `mystem -cd` format when started without "--format json".
+// The extension starts mystem with an empty environment and fixed arguments, so the emulated cost is read
+// from "<path of the binary>.conf", lines of "key = value":
+//   latency_us - delay added to every line, microseconds (0 by default)
+//   rate_kb    - throughput of the process, KB of input per second, 0 - unlimited (default)
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <time.h>
+
+#include "fake_mystem.h"
+
+static long latencyUs = 0;
+static long rateKb = 0;
+
+static void readConfig(const char *_binary) {
+    std::string path = std::string(_binary) + ".conf";
+    FILE *file = fopen(path.c_str(), "r");
+    if (file == nullptr) {
+        return;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), file) != nullptr) {
+        char key[64];
+        long value = 0;
+        if (sscanf(line, " %63[a-z_] = %ld", key, &value) != 2) {
+            continue;
+        }
+        if (strcmp(key, "latency_us") == 0) {
+            latencyUs = value;
+        } else if (strcmp(key, "rate_kb") == 0) {
+            rateKb = value;
+        }
+    }
+    fclose(file);
+}
+
+static void emulateCost(std::size_t _bytes) {
+    long usecs = latencyUs;
+    if (rateKb > 0) {
+        usecs += static_cast<long>(_bytes * 1000000ULL / (static_cast<unsigned long long>(rateKb) * 1024));
+    }
+    if (usecs > 0) {
+        struct timespec delay = {usecs / 1000000, (usecs % 1000000) * 1000};
+        while (nanosleep(&delay, &delay) != 0) {
+        }
+    }
+}
+
+int main(int _argc, char **_argv) {
+    readConfig(_argv[0]);
+    bool json = false;
+    for (int i = 1; i + 1 < _argc; ++i) {
+        json = json || (strcmp(_argv[i], "--format") == 0 && strcmp(_argv[i + 1], "json") == 0);
+    }
+    
+    std::string line;
+    std::string out;
+    int c;
+    while ((c = getchar_unlocked()) != EOF) {
+        if (c != '\n') {
+            line += static_cast<char>(c);
+            continue;
+        }
+        out.clear();
+        if (json) {
+            fake_mystem::convertLine(line.data(), line.length(), out);
+        } else {
+            fake_mystem::convertTextLine(line.data(), line.length(), out);
+        }
+        emulateCost(line.length() + 1);
+        fwrite(out.data(), 1, out.length(), stdout);
+        fflush(stdout);
+        line.clear();
+    }
+    
+    return 0;
+}
@@ -0,0 +1,130 @@
+// Deterministic stand-in for `mystem -cd --format json` and plain `mystem -cd`: every input line produces
+// one output line. A word is a run of ASCII letters and digits or of non-ASCII characters; Cyrillic words
+// are analysed and their lemma is the lowercased word, other words get an empty analysis. In JSON everything
+// else is passed as a text object and the line ends with a "\n" text object, as mystem does; in the plain
+// format a lemma follows its word in braces and the rest is copied as is.
+#ifndef FAKE_MYSTEM_H
+#define FAKE_MYSTEM_H
+
+#include <string>
+#include <cstddef>
+#include <cctype>
+#include <cstdio>
+
+namespace fake_mystem {
+    static inline bool wordByte(unsigned char _byte) {
+        return _byte >= 0x80 || isalnum(_byte) != 0;
+    }
+    
+    static void appendEscaped(std::string &_out, const char *_text, std::size_t _length) {
+        for (std::size_t i = 0; i < _length; ++i) {
+            unsigned char c = static_cast<unsigned char>(_text[i]);
+            if (c == '"' || c == '\\') {
+                _out += '\\';
+                _out += static_cast<char>(c);
+            } else if (c == '\n') {
+                _out += "\\n";
+            } else if (c == '\t') {
+                _out += "\\t";
+            } else if (c < 0x20) {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                _out += escaped;
+            } else {
+                _out += static_cast<char>(c);
+            }
+        }
+    }
+    
+    // lowercases Cyrillic (U+0400 - U+042F) and ASCII letters, returns false if the word has no Cyrillic letters
+    static bool lemma(const char *_word, std::size_t _length, std::string &_lemma) {
+        bool cyrillic = false;
+        _lemma.clear();
+        for (std::size_t i = 0; i < _length; ++i) {
+            unsigned char c = static_cast<unsigned char>(_word[i]);
+            if (c == 0xD0 && i + 1 < _length) {
+                unsigned char next = static_cast<unsigned char>(_word[i + 1]);
+                cyrillic = true;
+                ++i;
+                if (next >= 0x90 && next <= 0x9F) {
+                    _lemma += static_cast<char>(0xD0);
+                    _lemma += static_cast<char>(next + 0x20);
+                } else if (next >= 0xA0 && next <= 0xAF) {
+                    _lemma += static_cast<char>(0xD1);
+                    _lemma += static_cast<char>(next - 0x20);
+                } else if (next >= 0x80 && next <= 0x8F) {
+                    _lemma += static_cast<char>(0xD1);
+                    _lemma += static_cast<char>(next + 0x10);
+                } else {
+                    _lemma += static_cast<char>(c);
+                    _lemma += static_cast<char>(next);
+                }
+            } else {
+                cyrillic = cyrillic || (c >= 0xD1 && c <= 0xD3);
+                _lemma += static_cast<char>(tolower(c));
+            }
+        }
+        
+        return cyrillic;
+    }
+    
+    // appends the mystem output of the line (without its '\n') and the trailing '\n' to _out
+    static void convertLine(const char *_line, std::size_t _length, std::string &_out) {
+        std::string lex;
+        _out += '[';
+        std::size_t pos = 0;
+        while (pos < _length) {
+            std::size_t end = pos;
+            bool word = wordByte(static_cast<unsigned char>(_line[pos]));
+            while (end < _length && wordByte(static_cast<unsigned char>(_line[end])) == word) {
+                ++end;
+            }
+            if (pos > 0) {
+                _out += ',';
+            }
+            if (!word) {
+                _out += "{\"text\":\"";
+                appendEscaped(_out, _line + pos, end - pos);
+                _out += "\"}";
+            } else if (lemma(_line + pos, end - pos, lex)) {
+                _out += "{\"analysis\":[{\"lex\":\"";
+                appendEscaped(_out, lex.data(), lex.length());
+                _out += "\",\"wt\":1,\"gr\":\"S,m,inan=nom,sg\"}],\"text\":\"";
+                appendEscaped(_out, _line + pos, end - pos);
+                _out += "\"}";
+            } else {
+                _out += "{\"analysis\":[],\"text\":\"";
+                appendEscaped(_out, _line + pos, end - pos);
+                _out += "\"}";
+            }
+            pos = end;
+        }
+        if (_length > 0) {
+            _out += ',';
+        }
+        _out += "{\"text\":\"\\n\"}]\n";
+    }
+    
+    // appends the plain mystem output of the line (without its '\n') and the trailing '\n' to _out
+    static void convertTextLine(const char *_line, std::size_t _length, std::string &_out) {
+        std::string lex;
+        std::size_t pos = 0;
+        while (pos < _length) {
+            std::size_t end = pos;
+            bool word = wordByte(static_cast<unsigned char>(_line[pos]));
+            while (end < _length && wordByte(static_cast<unsigned char>(_line[end])) == word) {
+                ++end;
+            }
+            _out.append(_line + pos, end - pos);
+            if (word && lemma(_line + pos, end - pos, lex)) {
+                _out += '{';
+                _out += lex;
+                _out += '}';
+            }
+            pos = end;
+        }
+        _out += '\n';
+    }
+}
+
+#endif
@@ -0,0 +1,205 @@
+// Microbenchmarks of the extension internals: queue round trips between backend and worker threads and
+// conversion of mystem JSON and plain text output to lemmas. The extension source is compiled in, backend services
+// are replaced by pg_stubs.cpp. Every case reports throughput and p50/p99 latency of an operation.
+//
+//   ./micro_bench [seconds per case, 2 by default]
+#include "../pg_mystem.cpp"
+#include "fake_mystem.h"
+
+#include <chrono>
+#include <thread>
+#include <cstdio>
+
+namespace {
+    typedef std::chrono::steady_clock benchClock_t;
+    
+    uint64_t nanosSince(benchClock_t::time_point _start) {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(benchClock_t::now() -
+                                                                                           _start).count());
+    }
+    
+    void report(const std::string &_name, std::vector<uint64_t> &_latencies, double _seconds, uint64_t _bytes) {
+        if (_latencies.empty()) {
+            printf("%-36s no operations completed\n", _name.c_str());
+            return;
+        }
+        std::sort(_latencies.begin(), _latencies.end());
+        double p50 = _latencies[_latencies.size() / 2] / 1000.0;
+        double p99 = _latencies[std::min(_latencies.size() - 1, _latencies.size() * 99 / 100)] / 1000.0;
+        printf("%-36s %12.0f ops/s %9.2f MB/s   p50 %9.2f us   p99 %9.2f us\n", _name.c_str(),
+               _latencies.size() / _seconds, _bytes / _seconds / (1024.0 * 1024.0), p50, p99);
+        fflush(stdout);
+    }
+    
+    // deterministic Russian text of the given length, cut at a character boundary
+    std::string makeDocument(std::size_t _length, uint32_t _seed) {
+        static const char *words[] = {
+            "Мама", "мыла", "раму", "сегодня", "вечером", "большой", "дом", "стоял", "на", "краю", "деревни",
+            "полнотекстовый", "поиск", "работает", "быстро", "словоформы", "леммы", "и", "в", "PostgreSQL",
+            "запрос", "документы", "обрабатываются", "процессом", "2024", "года", "очередь", "результаты"
+        };
+        static const char *separators[] = {" ", " ", " ", ", ", ". ", " - "};
+        std::string doc;
+        uint32_t state = _seed * 2654435761U + 1;
+        while (doc.length() < _length) {
+            state = state * 1103515245U + 12345U;
+            doc += words[(state >> 8) % (sizeof(words) / sizeof(words[0]))];
+            doc += separators[(state >> 20) % (sizeof(separators) / sizeof(separators[0]))];
+        }
+        std::size_t length = _length;
+        while (length > 0 && (static_cast<unsigned char>(doc[length]) & 0xC0) == 0x80) {
+            --length;
+        }
+        doc.resize(length);
+        
+        return doc;
+    }
+    
+    // _producers backends submit documents and wait for them, _consumers workers echo the documents back
+    void benchQueue(int _producers, int _consumers, std::size_t _docLength, double _seconds) {
+        pg_ms::inOutQueue_t queue;
+        std::atomic<bool> stop(false);
+        std::atomic<bool> stopConsumers(false);
+        std::vector<std::vector<uint64_t>> latencies(_producers);
+        std::vector<std::thread> consumers;
+        std::vector<std::thread> producers;
+        
+        for (int i = 0; i < _consumers; ++i) {
+            consumers.emplace_back([&queue, &stopConsumers, i]() {
+                uint8_t worker = static_cast<uint8_t>(pg_ms::interactiveWorkers + i);
+                std::string text;
+                pg_ms::requestKind_t kind;
+                while (!stopConsumers.load(std::memory_order_relaxed)) {
+                    uint64_t id = queue.getInQueueRecord(worker, text, kind);
+                    if (id == 0) {
+                        std::this_thread::yield();
+                        continue;
+                    }
+                    while (!queue.setOutQueueRecord(id, text)) {
+                        std::this_thread::yield();
+                    }
+                }
+            });
+        }
+        
+        benchClock_t::time_point start = benchClock_t::now();
+        for (int i = 0; i < _producers; ++i) {
+            producers.emplace_back([&queue, &stop, &latencies, i, _docLength]() {
+                std::string doc = makeDocument(_docLength, static_cast<uint32_t>(i));
+                std::string result;
+                pg_ms::inOutQueue_t::lane_t lane = (_docLength <= pg_ms::interactiveLengthMax) ?
+                                                   pg_ms::inOutQueue_t::LANE_INTERACTIVE :
+                                                   pg_ms::inOutQueue_t::LANE_BULK;
+                while (!stop.load(std::memory_order_relaxed)) {
+                    benchClock_t::time_point opStart = benchClock_t::now();
+                    uint64_t id = 0;
+                    while ((id = queue.setInQueueRecord(doc.data(), doc.length(), pg_ms::REQUEST_TEXT, lane)) == 0) {
+                        std::this_thread::yield();
+                    }
+                    bool failed = false;
+                    while (!queue.getOutQueueRecord(id, result, failed)) {
+                        std::this_thread::yield();
+                    }
+                    latencies[i].push_back(nanosSince(opStart));
+                }
+            });
+        }
+        
+        std::this_thread::sleep_for(std::chrono::duration<double>(_seconds));
+        stop.store(true);
+        for (auto &thread:producers) {
+            thread.join();
+        }
+        double seconds = nanosSince(start) / 1e9;
+        // consumers serve the documents in flight until every producer is done
+        stopConsumers.store(true);
+        for (auto &thread:consumers) {
+            thread.join();
+        }
+        
+        std::vector<uint64_t> all;
+        for (auto &producer:latencies) {
+            all.insert(all.end(), producer.begin(), producer.end());
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "queue %dp/%dc %zuB", _producers, _consumers, _docLength);
+        report(name, all, seconds, all.size() * _docLength);
+    }
+    
+    // parses the fake mystem output of a document the way workers do, in either protocol, with or without
+    // the word cache; the output size shows the bytes each protocol passes through the pipe
+    void benchParse(std::size_t _docLength, pg_ms::mystemProtocol_t _protocol, bool _wordCache, double _seconds) {
+        std::string doc = makeDocument(_docLength, 1) + " " + pg_ms::mystemParagraphEndMarker;
+        std::string output;
+        if (_protocol == pg_ms::MYSTEM_PROTOCOL_TEXT) {
+            fake_mystem::convertTextLine(doc.data(), doc.length(), output);
+        } else {
+            fake_mystem::convertLine(doc.data(), doc.length(), output);
+        }
+        output.pop_back();
+        
+        pg_ms::wordCache_t *cache = _wordCache ? pg_ms::wordCache_t::attach(pg_ms::wordCacheSize * 1024L) : nullptr;
+        rapidjson::MemoryPoolAllocator<> allocator;
+        rapidjson::GenericReader<rapidjson::UTF8<>, rapidjson::UTF8<>, rapidjson::MemoryPoolAllocator<>>
+                reader(&allocator);
+        std::vector<char> line(output.length() + 1);
+        std::string normLine;
+        std::vector<uint64_t> latencies;
+        
+        benchClock_t::time_point start = benchClock_t::now();
+        while (nanosSince(start) < _seconds * 1e9) {
+            memcpy(line.data(), output.c_str(), output.length() + 1);
+            benchClock_t::time_point opStart = benchClock_t::now();
+            normLine.clear();
+            if (_protocol == pg_ms::MYSTEM_PROTOCOL_TEXT) {
+                pg_ms::mystemTextScanner_t scanner(normLine, cache, pg_ms::REQUEST_TEXT);
+                scanner.scan(line.data(), output.length());
+            } else {
+                pg_ms::mystemJsonHandler_t handler(normLine, cache, pg_ms::REQUEST_TEXT);
+                rapidjson::InsituStringStream stream(line.data());
+                if (reader.Parse<rapidjson::kParseInsituFlag>(stream, handler).IsError()) {
+                    fprintf(stderr, "JSON parsing failed\n");
+                    return;
+                }
+            }
+            latencies.push_back(nanosSince(opStart));
+        }
+        double seconds = nanosSince(start) / 1e9;
+        
+        char name[64];
+        snprintf(name, sizeof(name), "parse %s %zuB (out %zuB)%s",
+                 (_protocol == pg_ms::MYSTEM_PROTOCOL_TEXT) ? "text" : "json", _docLength, output.length(),
+                 _wordCache ? " +wc" : "");
+        report(name, latencies, seconds, latencies.size() * _docLength);
+    }
+}
+
+int main(int _argc, char **_argv) {
+    double seconds = (_argc > 1) ? atof(_argv[1]) : 2.0;
+    if (seconds <= 0) {
+        fprintf(stderr, "usage: %s [seconds per case]\n", _argv[0]);
+        return 1;
+    }
+    
+    // the snapshot of a real cluster must not leak into the word cache cases
+    pg_ms::wordSnapshotInterval = 0;
+    pg_ms::inOutQueue_t::init();
+    pg_ms::mystemStats_t::init();
+    pg_ms::wordCache_t::init(pg_ms::wordCacheSize * 1024L);
+    
+    const std::size_t docLengths[] = {256, 1024, 8192};
+    const int threads[][2] = {{1, 1}, {4, 2}, {16, 8}};
+    for (auto length:docLengths) {
+        for (auto &pair:threads) {
+            benchQueue(pair[0], std::min(pair[1], pg_ms::maxWorkers - pg_ms::interactiveWorkers), length, seconds);
+        }
+    }
+    for (auto length:docLengths) {
+        for (auto protocol:{pg_ms::MYSTEM_PROTOCOL_JSON, pg_ms::MYSTEM_PROTOCOL_TEXT}) {
+            benchParse(length, protocol, false, seconds);
+            benchParse(length, protocol, true, seconds);
+        }
+    }
+    
+    return 0;
+}
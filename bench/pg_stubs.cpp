@@ -0,0 +1,567 @@
+// Every backend symbol the extension code references, so the microbenchmarks run it outside of PostgreSQL and
+// link without unresolved symbols: shared memory is process memory, LWLocks are mutexes, latches do nothing,
+// memory contexts are malloc() and elog prints to stderr. The services the benchmarks do not use (SQL functions,
+// SPI, GUCs, background workers) abort when called.
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdarg>
+#include <map>
+#include <mutex>
+#include <string>
+#include <time.h>
+
+extern "C" {
+    #include <postgres.h>
+    #include <miscadmin.h>
+    #include <fmgr.h>
+    #include <funcapi.h>
+    #include <postmaster/autovacuum.h>
+    #include <postmaster/bgworker.h>
+    #include <storage/ipc.h>
+    #include <storage/latch.h>
+    #include <storage/lwlock.h>
+    #include <storage/proc.h>
+    #include <storage/procarray.h>
+    #include <storage/shmem.h>
+    #include <access/hash.h>
+    #include <access/htup_details.h>
+    #include <access/twophase.h>
+    #include <access/xact.h>
+    #include <executor/spi.h>
+    #include <utils/array.h>
+    #include <utils/builtins.h>
+    #include <utils/guc.h>
+    #include <utils/memutils.h>
+    #include <utils/timestamp.h>
+    #include <pgstat.h>
+    
+    static const int benchLocksNo = 64;
+    
+    static PGPROC benchProc;
+    static LWLockPadded benchLocks[benchLocksNo];
+    static std::mutex benchLockMutexes[benchLocksNo];
+    
+    static PROC_HDR *benchProcHeader() {
+        static PROC_HDR header;
+        header.allProcs = &benchProc;
+        return &header;
+    }
+    
+    // a backend service the benchmarks do not use
+    static void notInBench(const char *_name) {
+        fprintf(stderr, "%s is not available in the benchmarks\n", _name);
+        abort();
+    }
+    
+    PGPROC *MyProc = &benchProc;
+    PROC_HDR *ProcGlobal = benchProcHeader();
+    int MyProcPid = 1;
+    struct Latch *MyLatch = &benchProc.procLatch;
+    volatile bool InterruptPending = false;
+    volatile bool QueryCancelPending = false;
+    volatile bool ProcDiePending = false;
+    volatile uint32 InterruptHoldoffCount = 0;
+    volatile uint32 QueryCancelHoldoffCount = 0;
+    volatile uint32 CritSectionCount = 0;
+    MemoryContext CurrentMemoryContext = NULL;
+    MemoryContext TopMemoryContext = NULL;
+    shmem_startup_hook_type shmem_startup_hook = NULL;
+    LWLockPadded *MainLWLockArray = benchLocks;
+    bool process_shared_preload_libraries_in_progress = false;
+    bool pgstat_track_activities = false;
+    int MaxConnections = 100;
+    int autovacuum_max_workers = 3;
+    int max_worker_processes = 8;
+    int max_prepared_xacts = 0;
+    uint64 SPI_processed = 0;
+    SPITupleTable *SPI_tuptable = NULL;
+    
+    static std::mutex shmemLock;
+    static std::map<std::string, void *> shmemStructs;
+    
+    void *ShmemInitStruct(const char *name, Size size, bool *foundPtr) {
+        std::lock_guard<std::mutex> guard(shmemLock);
+        auto it = shmemStructs.find(name);
+        *foundPtr = (it != shmemStructs.end());
+        if (*foundPtr) {
+            return it->second;
+        }
+        void *memory = nullptr;
+        if (posix_memalign(&memory, PG_CACHE_LINE_SIZE, size) != 0) {
+            fprintf(stderr, "out of memory allocating \"%s\"\n", name);
+            abort();
+        }
+        memset(memory, 0, size);
+        shmemStructs[name] = memory;
+        return memory;
+    }
+    
+    void RequestAddinShmemSpace(Size size) {
+        (void) size;
+    }
+    
+    void RequestNamedLWLockTranche(const char *tranche_name, int num_lwlocks) {
+        (void) tranche_name;
+        (void) num_lwlocks;
+    }
+    
+    LWLockPadded *GetNamedLWLockTranche(const char *tranche_name) {
+        (void) tranche_name;
+        return benchLocks;
+    }
+    
+    // every lock is one of benchLocks, named tranches and AddinShmemInitLock alike
+    bool LWLockAcquire(LWLock *lock, LWLockMode mode) {
+        (void) mode;
+        benchLockMutexes[reinterpret_cast<LWLockPadded *>(lock) - benchLocks].lock();
+        return true;
+    }
+    
+    void LWLockRelease(LWLock *lock) {
+        benchLockMutexes[reinterpret_cast<LWLockPadded *>(lock) - benchLocks].unlock();
+    }
+    
+    void SetLatch(volatile Latch *latch) {
+        (void) latch;
+    }
+    
+    void ResetLatch(volatile Latch *latch) {
+        (void) latch;
+    }
+    
+    // nothing sets a latch, the wait is a short sleep
+    int WaitLatch(volatile Latch *latch, int wakeEvents, long timeout) {
+        (void) latch;
+        struct timespec pause = {0, 100000};
+        if ((wakeEvents & WL_TIMEOUT) && timeout >= 0 && timeout < 1) {
+            pause.tv_nsec = 0;
+        }
+        nanosleep(&pause, NULL);
+        return (wakeEvents & WL_TIMEOUT) ? WL_TIMEOUT : WL_LATCH_SET;
+    }
+    
+    WaitEventSet *CreateWaitEventSet(MemoryContext context, int nevents) {
+        (void) context;
+        (void) nevents;
+        notInBench("CreateWaitEventSet");
+        return NULL;
+    }
+    
+    int AddWaitEventToSet(WaitEventSet *set, uint32 events, pgsocket fd, Latch *latch, void *user_data) {
+        (void) set;
+        (void) events;
+        (void) fd;
+        (void) latch;
+        (void) user_data;
+        notInBench("AddWaitEventToSet");
+        return -1;
+    }
+    
+    void ModifyWaitEvent(WaitEventSet *set, int pos, uint32 events, Latch *latch) {
+        (void) set;
+        (void) pos;
+        (void) events;
+        (void) latch;
+        notInBench("ModifyWaitEvent");
+    }
+    
+    int WaitEventSetWait(WaitEventSet *set, long timeout, WaitEvent *occurred_events, int nevents) {
+        (void) set;
+        (void) timeout;
+        (void) occurred_events;
+        (void) nevents;
+        notInBench("WaitEventSetWait");
+        return 0;
+    }
+    
+    void FreeWaitEventSet(WaitEventSet *set) {
+        (void) set;
+        notInBench("FreeWaitEventSet");
+    }
+    
+    // the benchmark threads are one process
+    PGPROC *BackendPidGetProc(int pid) {
+        return (pid == MyProcPid) ? MyProc : NULL;
+    }
+    
+    void ProcessInterrupts(void) {
+        InterruptPending = false;
+    }
+    
+    void before_shmem_exit(pg_on_exit_callback function, Datum arg) {
+        (void) function;
+        (void) arg;
+    }
+    
+    void proc_exit(int code) {
+        exit(code);
+    }
+    
+    pqsigfunc pqsignal(int signo, pqsigfunc func) {
+        (void) signo;
+        (void) func;
+        notInBench("pqsignal");
+        return NULL;
+    }
+    
+    TimestampTz GetCurrentTimestamp(void) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        return static_cast<TimestampTz>(now.tv_sec) * USECS_PER_SEC + now.tv_nsec / 1000;
+    }
+    
+    void TimestampDifference(TimestampTz start_time, TimestampTz stop_time, long *secs, int *microsecs) {
+        TimestampTz diff = stop_time - start_time;
+        if (diff <= 0) {
+            *secs = 0;
+            *microsecs = 0;
+        } else {
+            *secs = static_cast<long>(diff / USECS_PER_SEC);
+            *microsecs = static_cast<int>(diff % USECS_PER_SEC);
+        }
+    }
+    
+    bool TimestampDifferenceExceeds(TimestampTz start_time, TimestampTz stop_time, int msec) {
+        return (stop_time - start_time) >= static_cast<TimestampTz>(msec) * 1000;
+    }
+    
+    // FNV-1a, the benchmarks only need a well spread hash
+    Datum hash_any(const unsigned char *k, int keylen) {
+        uint32 hash = 2166136261U;
+        for (int i = 0; i < keylen; ++i) {
+            hash = (hash ^ k[i]) * 16777619U;
+        }
+        return UInt32GetDatum(hash);
+    }
+    
+    void *palloc(Size size) {
+        void *pointer = malloc(size);
+        if (pointer == NULL) {
+            fprintf(stderr, "out of memory\n");
+            abort();
+        }
+        return pointer;
+    }
+    
+    void *palloc0(Size size) {
+        return memset(palloc(size), 0, size);
+    }
+    
+    void *palloc_extended(Size size, int flags) {
+        void *pointer = malloc(size);
+        if (pointer == NULL) {
+            if ((flags & MCXT_ALLOC_NO_OOM) != 0) {
+                return NULL;
+            }
+            fprintf(stderr, "out of memory\n");
+            abort();
+        }
+        if ((flags & MCXT_ALLOC_ZERO) != 0) {
+            memset(pointer, 0, size);
+        }
+        return pointer;
+    }
+    
+    void pfree(void *pointer) {
+        free(pointer);
+    }
+    
+    char *pstrdup(const char *in) {
+        return pnstrdup(in, strlen(in));
+    }
+    
+    char *pnstrdup(const char *in, Size len) {
+        len = strnlen(in, len);
+        char *out = static_cast<char *>(palloc(len + 1));
+        memcpy(out, in, len);
+        out[len] = '\0';
+        return out;
+    }
+    
+    char *MemoryContextStrdup(MemoryContext context, const char *string) {
+        (void) context;
+        return pstrdup(string);
+    }
+    
+    // the benchmarks make plain varlenas only
+    struct varlena *pg_detoast_datum(struct varlena *datum) {
+        return datum;
+    }
+    
+    struct varlena *pg_detoast_datum_packed(struct varlena *datum) {
+        return datum;
+    }
+    
+    text *cstring_to_text_with_len(const char *s, int len) {
+        text *result = static_cast<text *>(palloc(len + VARHDRSZ));
+        SET_VARSIZE(result, len + VARHDRSZ);
+        memcpy(VARDATA(result), s, len);
+        return result;
+    }
+    
+    text *cstring_to_text(const char *s) {
+        return cstring_to_text_with_len(s, strlen(s));
+    }
+    
+    char *text_to_cstring(const text *t) {
+        return pnstrdup(VARDATA_ANY(t), VARSIZE_ANY_EXHDR(t));
+    }
+    
+    Datum Float8GetDatum(float8 X) {
+        Datum result;
+        static_assert(sizeof(result) == sizeof(X), "float8 is passed by value");
+        memcpy(&result, &X, sizeof(result));
+        return result;
+    }
+    
+    void deconstruct_array(ArrayType *array, Oid elmtype, int elmlen, bool elmbyval, char elmalign, Datum **elemsp,
+                           bool **nullsp, int *nelemsp) {
+        (void) array;
+        (void) elmtype;
+        (void) elmlen;
+        (void) elmbyval;
+        (void) elmalign;
+        (void) elemsp;
+        (void) nullsp;
+        (void) nelemsp;
+        notInBench("deconstruct_array");
+    }
+    
+    ArrayType *construct_md_array(Datum *elems, bool *nulls, int ndims, int *dims, int *lbs, Oid elmtype,
+                                  int elmlen, bool elmbyval, char elmalign) {
+        (void) elems;
+        (void) nulls;
+        (void) ndims;
+        (void) dims;
+        (void) lbs;
+        (void) elmtype;
+        (void) elmlen;
+        (void) elmbyval;
+        (void) elmalign;
+        notInBench("construct_md_array");
+        return NULL;
+    }
+    
+    TypeFuncClass get_call_result_type(FunctionCallInfo fcinfo, Oid *resultTypeId, TupleDesc *resultTupleDesc) {
+        (void) fcinfo;
+        (void) resultTypeId;
+        (void) resultTupleDesc;
+        notInBench("get_call_result_type");
+        return TYPEFUNC_OTHER;
+    }
+    
+    Oid get_fn_expr_argtype(FmgrInfo *flinfo, int argnum) {
+        (void) flinfo;
+        (void) argnum;
+        notInBench("get_fn_expr_argtype");
+        return InvalidOid;
+    }
+    
+    TupleDesc BlessTupleDesc(TupleDesc tupdesc) {
+        (void) tupdesc;
+        notInBench("BlessTupleDesc");
+        return NULL;
+    }
+    
+    HeapTuple heap_form_tuple(TupleDesc tupleDescriptor, Datum *values, bool *isnull) {
+        (void) tupleDescriptor;
+        (void) values;
+        (void) isnull;
+        notInBench("heap_form_tuple");
+        return NULL;
+    }
+    
+    Datum HeapTupleHeaderGetDatum(HeapTupleHeader tuple) {
+        (void) tuple;
+        notInBench("HeapTupleHeaderGetDatum");
+        return 0;
+    }
+    
+    FuncCallContext *init_MultiFuncCall(PG_FUNCTION_ARGS) {
+        (void) fcinfo;
+        notInBench("init_MultiFuncCall");
+        return NULL;
+    }
+    
+    FuncCallContext *per_MultiFuncCall(PG_FUNCTION_ARGS) {
+        (void) fcinfo;
+        notInBench("per_MultiFuncCall");
+        return NULL;
+    }
+    
+    void end_MultiFuncCall(PG_FUNCTION_ARGS, FuncCallContext *funcctx) {
+        (void) fcinfo;
+        (void) funcctx;
+        notInBench("end_MultiFuncCall");
+    }
+    
+    void RegisterExprContextCallback(ExprContext *econtext, ExprContextCallbackFunction function, Datum arg) {
+        (void) econtext;
+        (void) function;
+        (void) arg;
+        notInBench("RegisterExprContextCallback");
+    }
+    
+    void UnregisterExprContextCallback(ExprContext *econtext, ExprContextCallbackFunction function, Datum arg) {
+        (void) econtext;
+        (void) function;
+        (void) arg;
+        notInBench("UnregisterExprContextCallback");
+    }
+    
+    void RegisterXactCallback(XactCallback callback, void *arg) {
+        (void) callback;
+        (void) arg;
+        notInBench("RegisterXactCallback");
+    }
+    
+    int SPI_connect(void) {
+        notInBench("SPI_connect");
+        return 0;
+    }
+    
+    int SPI_finish(void) {
+        notInBench("SPI_finish");
+        return 0;
+    }
+    
+    Portal SPI_cursor_open_with_args(const char *name, const char *src, int nargs, Oid *argtypes, Datum *Values,
+                                     const char *Nulls, bool read_only, int cursorOptions) {
+        (void) name;
+        (void) src;
+        (void) nargs;
+        (void) argtypes;
+        (void) Values;
+        (void) Nulls;
+        (void) read_only;
+        (void) cursorOptions;
+        notInBench("SPI_cursor_open_with_args");
+        return NULL;
+    }
+    
+    Portal SPI_cursor_find(const char *name) {
+        (void) name;
+        notInBench("SPI_cursor_find");
+        return NULL;
+    }
+    
+    void SPI_cursor_fetch(Portal portal, bool forward, long count) {
+        (void) portal;
+        (void) forward;
+        (void) count;
+        notInBench("SPI_cursor_fetch");
+    }
+    
+    void SPI_cursor_close(Portal portal) {
+        (void) portal;
+        notInBench("SPI_cursor_close");
+    }
+    
+    Datum SPI_getbinval(HeapTuple tuple, TupleDesc tupdesc, int fnumber, bool *isnull) {
+        (void) tuple;
+        (void) tupdesc;
+        (void) fnumber;
+        (void) isnull;
+        notInBench("SPI_getbinval");
+        return 0;
+    }
+    
+    Oid SPI_gettypeid(TupleDesc tupdesc, int fnumber) {
+        (void) tupdesc;
+        (void) fnumber;
+        notInBench("SPI_gettypeid");
+        return InvalidOid;
+    }
+    
+    void SPI_freetuptable(SPITupleTable *tuptable) {
+        (void) tuptable;
+        notInBench("SPI_freetuptable");
+    }
+    
+    void DefineCustomIntVariable(const char *name, const char *short_desc, const char *long_desc, int *valueAddr,
+                                 int bootValue, int minValue, int maxValue, GucContext context, int flags,
+                                 GucIntCheckHook check_hook, GucIntAssignHook assign_hook, GucShowHook show_hook) {
+        (void) name;
+        (void) short_desc;
+        (void) long_desc;
+        (void) valueAddr;
+        (void) bootValue;
+        (void) minValue;
+        (void) maxValue;
+        (void) context;
+        (void) flags;
+        (void) check_hook;
+        (void) assign_hook;
+        (void) show_hook;
+        notInBench("DefineCustomIntVariable");
+    }
+    
+    void DefineCustomEnumVariable(const char *name, const char *short_desc, const char *long_desc, int *valueAddr,
+                                  int bootValue, const struct config_enum_entry *options, GucContext context,
+                                  int flags, GucEnumCheckHook check_hook, GucEnumAssignHook assign_hook,
+                                  GucShowHook show_hook) {
+        (void) name;
+        (void) short_desc;
+        (void) long_desc;
+        (void) valueAddr;
+        (void) bootValue;
+        (void) options;
+        (void) context;
+        (void) flags;
+        (void) check_hook;
+        (void) assign_hook;
+        (void) show_hook;
+        notInBench("DefineCustomEnumVariable");
+    }
+    
+    void EmitWarningsOnPlaceholders(const char *className) {
+        (void) className;
+        notInBench("EmitWarningsOnPlaceholders");
+    }
+    
+    void ProcessConfigFile(GucContext context) {
+        (void) context;
+        notInBench("ProcessConfigFile");
+    }
+    
+    void RegisterBackgroundWorker(BackgroundWorker *worker) {
+        (void) worker;
+        notInBench("RegisterBackgroundWorker");
+    }
+    
+    bool RegisterDynamicBackgroundWorker(BackgroundWorker *worker, BackgroundWorkerHandle **handle) {
+        (void) worker;
+        (void) handle;
+        notInBench("RegisterDynamicBackgroundWorker");
+        return false;
+    }
+    
+    BgwHandleStatus GetBackgroundWorkerPid(BackgroundWorkerHandle *handle, pid_t *pidp) {
+        (void) handle;
+        (void) pidp;
+        notInBench("GetBackgroundWorkerPid");
+        return BGWH_STOPPED;
+    }
+    
+    void BackgroundWorkerUnblockSignals(void) {
+        notInBench("BackgroundWorkerUnblockSignals");
+    }
+    
+    void elog_start(const char *filename, int lineno, const char *funcname) {
+        (void) filename;
+        (void) lineno;
+        (void) funcname;
+    }
+    
+    void elog_finish(int elevel, const char *fmt, ...) {
+        va_list args;
+        va_start(args, fmt);
+        vfprintf(stderr, fmt, args);
+        va_end(args);
+        fputc('\n', stderr);
+        if (elevel >= ERROR) {
+            abort();
+        }
+    }
+}
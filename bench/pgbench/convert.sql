@@ -0,0 +1,2 @@
+\set id random(1, :docs)
+SELECT mystem_convert(doc) FROM mystem_bench_docs WHERE id = :id;
@@ -0,0 +1,17 @@
+-- documents of :doc_size characters for convert.sql, generated deterministically from a fixed vocabulary;
+-- psql -v docs=1000 -v doc_size=1024 -f setup.sql
+CREATE EXTENSION IF NOT EXISTS pg_mystem;
+DROP TABLE IF EXISTS mystem_bench_docs;
+CREATE TABLE mystem_bench_docs (id int PRIMARY KEY, doc text NOT NULL);
+
+SELECT setseed(0.5);
+INSERT INTO mystem_bench_docs
+SELECT id, left(string_agg(words[1 + floor(random() * array_length(words, 1))::int], ' '), :doc_size)
+FROM generate_series(1, :docs) AS id,
+     generate_series(1, :doc_size / 4) AS n,
+     (SELECT ARRAY['Мама', 'мыла', 'раму', 'сегодня', 'вечером', 'большой', 'дом', 'стоял', 'на', 'краю',
+                   'деревни', 'полнотекстовый', 'поиск', 'работает', 'быстро', 'словоформы', 'леммы', 'и', 'в',
+                   'PostgreSQL', 'запрос', 'документы', 'обрабатываются', 'процессом', 'года', 'очередь',
+                   'результаты', 'лемматизация', 'текста', 'расширение.'] AS words) AS vocabulary
+GROUP BY id;
+ANALYZE mystem_bench_docs;
@@ -0,0 +1,65 @@
+#!/bin/sh
+# End-to-end throughput of mystem_convert: sweeps the mystem output protocol, the number of mystem processes,
+# the document size and the number of clients, prints a CSV line per run with transactions and KB of text per second and
+# p50/p99 latency computed from the pgbench transaction log.
+#
+# The cluster must have pg_mystem in shared_preload_libraries and be controllable with pg_ctl, since
+# pg_mystem.protocol and pg_mystem.min_workers/max_workers need a restart. Install the fake mystem (make install-fake) to get
+# reproducible numbers without the real binary, and keep pg_mystem.result_cache_size at 0, otherwise
+# repeated documents never reach mystem. Settings come from the environment:
+#   PGDATA     - data directory of the cluster (required)
+#   PGDATABASE - database to run in (postgres)
+#   PROTOCOLS  - mystem output protocols ("json text")
+#   WORKERS    - numbers of mystem processes ("1 2 4 8")
+#   DOC_SIZES  - document sizes, characters ("256 1024 8192")
+#   CLIENTS    - numbers of pgbench clients ("1 4 16 64")
+#   DOCS       - documents per size (1000)
+#   DURATION   - seconds per run (30)
+set -e
+
+: "${PGDATA:?PGDATA must point to the data directory of the benchmarked cluster}"
+: "${PGDATABASE:=postgres}"
+: "${PROTOCOLS:=json text}"
+: "${WORKERS:=1 2 4 8}"
+: "${DOC_SIZES:=256 1024 8192}"
+: "${CLIENTS:=1 4 16 64}"
+: "${DOCS:=1000}"
+: "${DURATION:=30}"
+export PGDATABASE
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+RESULTS_DIR="$BENCH_DIR/results/$(date +%Y%m%d-%H%M%S)"
+mkdir -p "$RESULTS_DIR"
+
+echo "protocol,workers,doc_size,clients,tps,kb_per_sec,p50_ms,p99_ms" | tee "$RESULTS_DIR/summary.csv"
+for protocol in $PROTOCOLS; do
+    for workers in $WORKERS; do
+        # a fixed number of mystem processes, so the scaler does not blur the sweep
+        psql -q -X -c "ALTER SYSTEM SET pg_mystem.protocol = $protocol" \
+             -c "ALTER SYSTEM SET pg_mystem.min_workers = $workers" \
+             -c "ALTER SYSTEM SET pg_mystem.max_workers = $workers"
+        pg_ctl -D "$PGDATA" -w -l "$RESULTS_DIR/postgres.log" restart >/dev/null
+        
+        for size in $DOC_SIZES; do
+            psql -q -X -v ON_ERROR_STOP=1 -v docs="$DOCS" -v doc_size="$size" \
+                 -f "$BENCH_DIR/pgbench/setup.sql" >/dev/null
+            bytes=$(psql -A -t -X -c "SELECT avg(octet_length(doc))::bigint FROM mystem_bench_docs")
+            
+            for clients in $CLIENTS; do
+                run="$RESULTS_DIR/$protocol-w$workers-s$size-c$clients"
+                mkdir -p "$run"
+                (cd "$run" && pgbench -n -f "$BENCH_DIR/pgbench/convert.sql" -D docs="$DOCS" -c "$clients" \
+                                      -j "$clients" -T "$DURATION" -l >"$run/pgbench.out" 2>&1)
+                tps=$(sed -n 's/^tps = \([0-9.]*\) (excluding.*/\1/p' "$run/pgbench.out")
+                # the third column of the transaction log is the latency in microseconds
+                cat "$run"/pgbench_log.* | awk '{print $3}' | sort -n >"$run/latencies"
+                count=$(wc -l <"$run/latencies")
+                p50=$(awk -v n="$count" 'NR == int(n * 0.50) + 1 {printf "%.2f", $1 / 1000; exit}' "$run/latencies")
+                p99=$(awk -v n="$count" 'NR == int(n * 0.99) + 1 {printf "%.2f", $1 / 1000; exit}' "$run/latencies")
+                kbps=$(awk -v tps="$tps" -v bytes="$bytes" 'BEGIN {printf "%.1f", tps * bytes / 1024}')
+                echo "$protocol,$workers,$size,$clients,$tps,$kbps,$p50,$p99" | tee -a "$RESULTS_DIR/summary.csv"
+            done
+        done
+    done
+done
+echo "results are in $RESULTS_DIR"
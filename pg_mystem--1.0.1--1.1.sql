@@ -0,0 +1,95 @@
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION pg_mystem UPDATE TO '1.1'" to load this file. \quit
+ALTER FUNCTION mystem_convert(text) PARALLEL SAFE;
+
+CREATE FUNCTION mystem_convert(text[]) RETURNS text[]
+AS '$libdir/pg_mystem', 'mystem_convert_array'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION mystem_convert_set(text[], OUT ord int, OUT lemmas text) RETURNS SETOF record
+AS '$libdir/pg_mystem', 'mystem_convert_set'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION mystem_cache_stats(OUT cache text, OUT hits bigint, OUT misses bigint,
+                                   OUT insertions bigint, OUT evictions bigint) RETURNS SETOF record
+AS '$libdir/pg_mystem', 'mystem_cache_stats'
+LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION mystem_stat_workers(OUT worker int, OUT pid int, OUT documents bigint, OUT bytes bigint,
+                                    OUT busy_time float8, OUT idle_time float8, OUT restarts bigint)
+RETURNS SETOF record
+AS '$libdir/pg_mystem', 'mystem_stat_workers'
+LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION mystem_stat_queue(OUT queue_depth bigint, OUT documents bigint, OUT split_documents bigint)
+RETURNS record
+AS '$libdir/pg_mystem', 'mystem_stat_queue'
+LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION mystem_stat_latency(OUT stage text, OUT upper_usecs bigint, OUT count bigint)
+RETURNS SETOF record
+AS '$libdir/pg_mystem', 'mystem_stat_latency'
+LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION mystem_stat_reset() RETURNS void
+AS '$libdir/pg_mystem', 'mystem_stat_reset'
+LANGUAGE C VOLATILE STRICT PARALLEL UNSAFE;
+REVOKE ALL ON FUNCTION mystem_stat_reset() FROM PUBLIC;
+
+CREATE VIEW pg_stat_mystem AS
+    SELECT w.*, q.queue_depth, q.split_documents
+    FROM mystem_stat_workers() w, mystem_stat_queue() q;
+
+CREATE VIEW pg_stat_mystem_latency AS
+    SELECT * FROM mystem_stat_latency();
+
+CREATE FUNCTION mystem_prs_start(internal, int4) RETURNS internal
+AS '$libdir/pg_mystem', 'mystem_prs_start'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION mystem_prs_nexttoken(internal, internal, internal) RETURNS internal
+AS '$libdir/pg_mystem', 'mystem_prs_nexttoken'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION mystem_prs_end(internal) RETURNS void
+AS '$libdir/pg_mystem', 'mystem_prs_end'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION mystem_prs_lextype(internal) RETURNS internal
+AS '$libdir/pg_mystem', 'mystem_prs_lextype'
+LANGUAGE C STRICT;
+
+CREATE TEXT SEARCH PARSER mystem (
+    START = mystem_prs_start,
+    GETTOKEN = mystem_prs_nexttoken,
+    END = mystem_prs_end,
+    LEXTYPES = mystem_prs_lextype
+);
+
+CREATE TEXT SEARCH CONFIGURATION mystem (
+    PARSER = mystem
+);
+
+ALTER TEXT SEARCH CONFIGURATION mystem ADD MAPPING FOR lemma, word WITH simple;
+
+CREATE FUNCTION mystem_submit(text) RETURNS bigint
+AS '$libdir/pg_mystem', 'mystem_submit'
+LANGUAGE C VOLATILE STRICT PARALLEL UNSAFE;
+
+CREATE FUNCTION mystem_fetch(bigint, wait boolean DEFAULT true) RETURNS text
+AS '$libdir/pg_mystem', 'mystem_fetch'
+LANGUAGE C VOLATILE STRICT PARALLEL UNSAFE;
+
+CREATE FUNCTION mystem_cancel(bigint) RETURNS boolean
+AS '$libdir/pg_mystem', 'mystem_cancel'
+LANGUAGE C VOLATILE STRICT PARALLEL UNSAFE;
+
+CREATE FUNCTION mystem_convert_stream(query text, window_size int DEFAULT 64, OUT ord bigint, OUT lemmas text)
+RETURNS SETOF record
+AS '$libdir/pg_mystem', 'mystem_convert_stream'
+LANGUAGE C VOLATILE STRICT PARALLEL UNSAFE;
+
+CREATE FUNCTION mystem_convert_stream(cursor refcursor, window_size int DEFAULT 64, OUT ord bigint, OUT lemmas text)
+RETURNS SETOF record
+AS '$libdir/pg_mystem', 'mystem_convert_stream'
+LANGUAGE C VOLATILE STRICT PARALLEL UNSAFE;
@@ -3,335 +3,3620 @@
 #include <string.h>
 #include <fcntl.h>
 #include <sys/stat.h>
-#include <semaphore.h>
 #include <sys/mman.h>
+#include <sys/wait.h>
+#include <signal.h>
 
 #include <string>
 #include <vector>
-#include <random>
-#include <limits>
+#include <deque>
+#include <memory>
+#include <map>
+#include <unordered_map>
+#include <atomic>
+#include <new>
 #include <algorithm>
+#include <climits>
+#include <stdexcept>
 
-#include "rapidjson/document.h"
+#include "rapidjson/reader.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define MYSTEM_X86_SIMD
+#endif
+
+// static tracepoints of the request lifecycle, e.g. bpftrace -e 'usdt:pg_mystem.so:pg_mystem:enqueue {...}'
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define MYSTEM_PROBE0(name) DTRACE_PROBE(pg_mystem, name)
+#define MYSTEM_PROBE2(name, arg1, arg2) DTRACE_PROBE2(pg_mystem, name, arg1, arg2)
+#else
+#define MYSTEM_PROBE0(name) do {} while (0)
+#define MYSTEM_PROBE2(name, arg1, arg2) do {} while (0)
+#endif
 
 extern "C" {
     #include <postgres.h>
     #include <miscadmin.h>
+    #include <postmaster/autovacuum.h>
     #include <postmaster/bgworker.h>
     #include <storage/ipc.h>
     #include <storage/latch.h>
+    #include <storage/lwlock.h>
+    #include <storage/shmem.h>
+    #include <storage/proc.h>
+    #include <storage/procarray.h>
     #include <fmgr.h>
+    #include <funcapi.h>
+    #include <access/htup_details.h>
+    #include <catalog/pg_type.h>
+    #include <utils/array.h>
     #include <utils/builtins.h>
+    #include <utils/guc.h>
+    #include <utils/memutils.h>
+    #include <utils/timestamp.h>
+    #include <pgstat.h>
+    #include <tsearch/ts_public.h>
+    #include <access/hash.h>
+    #include <access/twophase.h>
+    #include <access/xact.h>
+    #include <executor/spi.h>
     
     PG_MODULE_MAGIC;
 }
 
 namespace pg_ms {
-#ifndef DOC_LEN_MAX
-#error "DOC_LEN_MAX must be defined"
-#else
-    static const uint32_t docLengthMax = DOC_LEN_MAX;
-#endif
+    static const std::string mystemParagraphEndMarker = "EndOfArticleMarker";
     
-#ifndef MYSTEM_PROCS
-#error "MYSTEM_PROCS must be defined"
-#else
-    static const uint8_t mystemProcNo = MYSTEM_PROCS;
-#endif
+    // ' ' + "EndOfArticleMarker" + '\n' + '\0'
+    static const uint32_t docPostfixLength = 21 * sizeof(char);
     
-    static const std::string mystemParagraphEndMarker = "EndOfArticleMarker";
+    // longer documents are split at paragraph, sentence or word boundaries into chunks processed by several
+    // workers at once and reassembled by the backend (pg_mystem.max_doc_len, bytes)
+    static int docLengthMax = 8192;
     
-    // document[DOC_LEN_MAX] + ' ' + "EndOfArticleMarker" + '\n' + '\0'
-    static const uint32_t docAndPostfixLengthMax = docLengthMax + 21 * sizeof(char);
+    // shared memory for documents and results in flight (pg_mystem.queue_memory, kB)
+    static int queueMemory = 8192;
     
-    static const useconds_t queueWaitTimeoutMax = 1000L; // wait for a record, milliseconds
+    // the launcher keeps from pg_mystem.min_workers to pg_mystem.max_workers mystem workers running;
+    // it adds workers when documents wait in the queue longer than scaleUpWait on average or when there are
+    // more of them than the running workers can take, and retires one worker per scaleInterval
+    // after scaleDownTicks quiet intervals
+    static const int workersMax = 64;
+    static int minWorkers = 2;
+    static int maxWorkers = 8;
+    static const long scaleInterval = 1000L; // milliseconds
+    static const uint64_t scaleUpWait = 50000; // microseconds
+    static const int scaleDownTicks = 30;
     
-    class inOutQueue_t {
+    // how mystem processes are driven (pg_mystem.worker_mode):
+    //   process     - a background worker per mystem process
+    //   multiplexed - the launcher itself drives all mystem processes from a single event loop,
+    //                 so the extension takes one background worker slot only
+    enum workerMode_t {
+        WORKER_MODE_PROCESS = 0,
+        WORKER_MODE_MULTIPLEXED
+    };
+    static const struct config_enum_entry workerModes[] = {
+        {"process", WORKER_MODE_PROCESS, false},
+        {"multiplexed", WORKER_MODE_MULTIPLEXED, false},
+        {NULL, 0, false}
+    };
+    static int workerMode = WORKER_MODE_PROCESS;
+    
+    // output format mystem is started with (pg_mystem.protocol):
+    //   json - mystem -cd --format json, parsed by a SAX reader; the format that carries grammemes
+    //   text - plain mystem -cd output, "word{lemma}", read by a scanner; no grammemes and a fraction
+    //          of the bytes, for mystem_convert and the text search parser that need lemmas only
+    enum mystemProtocol_t {
+        MYSTEM_PROTOCOL_JSON = 0,
+        MYSTEM_PROTOCOL_TEXT
+    };
+    static const struct config_enum_entry mystemProtocols[] = {
+        {"json", MYSTEM_PROTOCOL_JSON, false},
+        {"text", MYSTEM_PROTOCOL_TEXT, false},
+        {NULL, 0, false}
+    };
+    static int mystemProtocol = MYSTEM_PROTOCOL_JSON;
+    
+    // a document is converted either to text with words replaced by their lemmas or, for the text search
+    // parser, to a token list: one line per word, 'L' followed by the lemma or 'W' followed by a word
+    // mystem does not know; blanks and punctuation are dropped, tokens keep the document order
+    enum requestKind_t {
+        REQUEST_TEXT = 0,
+        REQUEST_TOKENS
+    };
+    static const char tokenLemma = 'L';
+    static const char tokenWord = 'W';
+    
+    // submitted documents wait in one of two lanes: short ones, up to interactiveLengthMax bytes, in the interactive
+    // lane, the rest in the bulk lane, unless the session sets pg_mystem.priority; the first
+    // pg_mystem.interactive_workers places take interactive documents only, the other workers prefer them too,
+    // but take bulk documents first once the bulk lane has not been served for bulkAgingTime
+    enum priority_t {
+        PRIORITY_AUTO = 0,
+        PRIORITY_INTERACTIVE,
+        PRIORITY_BULK
+    };
+    static const struct config_enum_entry priorities[] = {
+        {"auto", PRIORITY_AUTO, false},
+        {"interactive", PRIORITY_INTERACTIVE, false},
+        {"bulk", PRIORITY_BULK, false},
+        {NULL, 0, false}
+    };
+    static int priority = PRIORITY_AUTO;
+    static int interactiveWorkers = 1;
+    static const std::size_t interactiveLengthMax = 1024;
+    static const long bulkAgingTime = 500L; // milliseconds
+    
+    // places reserved for the interactive lane, at least one place is left for the bulk lane
+    static inline int reservedWorkers() {
+        return std::max(std::min(interactiveWorkers, maxWorkers - 1), 0);
+    }
+    
+    // workers kept running without load, reserved ones and one more for the bulk lane included
+    static inline int minRunningWorkers() {
+        return std::min(std::max(minWorkers, reservedWorkers() + 1), maxWorkers);
+    }
+    
+    static const long freeSlotWaitTimeout = 10L; // fallback wake up while waiting for a free slot, milliseconds
+    
+    // longest time a backend waits without any document of its call processed (pg_mystem.request_timeout,
+    // milliseconds, 0 - no limit); a worker whose mystem died starts it again after a delay that doubles
+    // from respawnDelayMin to respawnDelayMax while mystem keeps dying before it processes a document
+    static int requestTimeout = 60000;
+    static const long respawnDelayMin = 100L;
+    static const long respawnDelayMax = 10000L;
+    static const uint32_t slotWaitersMax = 1024; // backends waiting for a free slot, the rest fall back to the timeout
+    
+    // a worker keeps up to pipelineDepth documents in flight on its mystem child (pg_mystem.pipeline_depth),
+    // documents taken at once are passed to mystem with a single write
+    static const int pipelineDepthMax = 16;
+    static int pipelineDepth = 4;
+    
+    // word cache (pg_mystem.word_cache_size, kB) and the way mystem_convert uses it (pg_mystem.word_cache_mode):
+    //   off     - every document goes to mystem
+    //   context - a document is converted locally if all its words are cached, otherwise it goes to mystem
+    //             as a whole, so mystem still sees the words in context
+    //   tokens  - only unknown words go to mystem, out of context, the document is converted locally
+    enum wordCacheMode_t {
+        WORD_CACHE_OFF = 0,
+        WORD_CACHE_CONTEXT,
+        WORD_CACHE_TOKENS
+    };
+    static const struct config_enum_entry wordCacheModes[] = {
+        {"off", WORD_CACHE_OFF, false},
+        {"context", WORD_CACHE_CONTEXT, false},
+        {"tokens", WORD_CACHE_TOKENS, false},
+        {NULL, 0, false}
+    };
+    static int wordCacheSize = 16384;
+    static int wordCacheMode = WORD_CACHE_OFF;
+    
+    // whole-document result cache (pg_mystem.result_cache_size, kB), 0 disables the cache
+    static int resultCacheSize = 0;
+    
+    // error reported to the caller of the SQL function
+    class mystemError_t: public std::runtime_error {
     public:
-        static const uint16_t queueRecordsMax;
-        
-        struct inQueueRecord_t {
-            uint64_t m_id;
-            char m_text[docAndPostfixLengthMax];
-        };
-        struct outQueueRecord_t {
-            uint64_t m_id;
-            char m_text[docAndPostfixLengthMax];
+        explicit mystemError_t(const std::string &_what): std::runtime_error(_what) {
+        }
+    };
+    
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+                  "lock-free atomics are required to share them between processes");
+    
+    // Bounded lock-free MPMC ring of slot indexes (D. Vyukov's algorithm).
+    // The ring lives in shared memory, its cells are placed right after the header.
+    class slotRing_t {
+    private:
+        struct cell_t {
+            std::atomic<uint64_t> m_seq;
+            uint32_t m_slot;
         };
         
-    private:
-        static const char *inQueueSemName;
-        static const char *inQueueShmName;
+        uint64_t m_mask;
+        char m_pad1[64 - sizeof(uint64_t)];
+        std::atomic<uint64_t> m_enqueuePos; // producers and consumers are kept on different cache lines
+        char m_pad2[64 - sizeof(std::atomic<uint64_t>)];
+        std::atomic<uint64_t> m_dequeuePos;
         
-        static const char *outQueueSemName;
-        static const char *outQueueShmName;
+        cell_t *cells() {
+            return reinterpret_cast<cell_t *>(reinterpret_cast<char *>(this) + headerSize());
+        }
         
-        sem_t *m_inQueueSem;
-        sem_t *m_outQueueSem;
+        static std::size_t headerSize() {
+            return (sizeof(slotRing_t) + 63) & ~static_cast<std::size_t>(63);
+        }
         
-        int m_inQueueShm;
-        int m_outQueueShm;
+    public:
+        // ring capacity is the smallest power of two that is not less than _records
+        static uint64_t capacity(uint32_t _records) {
+            uint64_t ret = 1;
+            while (ret < _records) {
+                ret <<= 1;
+            }
+            return ret;
+        }
         
-        inQueueRecord_t *m_inQueue;
-        outQueueRecord_t *m_outQueue;
+        static std::size_t size(uint32_t _records) {
+            return headerSize() + sizeof(cell_t) * capacity(_records);
+        }
         
-        bool m_OK;
-        int m_errCode;
+        void init(uint32_t _records) {
+            uint64_t cap = capacity(_records);
+            m_mask = cap - 1;
+            new (&m_enqueuePos) std::atomic<uint64_t>(0);
+            new (&m_dequeuePos) std::atomic<uint64_t>(0);
+            for (uint64_t i = 0; i < cap; ++i) {
+                new (&cells()[i].m_seq) std::atomic<uint64_t>(i);
+                cells()[i].m_slot = 0;
+            }
+        }
         
-    public:
-        static bool init() {
-            sem_t *inQueueSem = sem_open(inQueueSemName, O_CREAT, 0600, 0);
-            if (inQueueSem == SEM_FAILED) {
-                elog(LOG, "MYSTEM: inOutQueue(1) init error = %d, %s", errno, strerror(errno));
-                return false;
+        bool push(uint32_t _slot) {
+            cell_t *cell;
+            uint64_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+            while (true) {
+                cell = &cells()[pos & m_mask];
+                uint64_t seq = cell->m_seq.load(std::memory_order_acquire);
+                int64_t diff = static_cast<int64_t>(seq) - static_cast<int64_t>(pos);
+                if (diff == 0) {
+                    if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        break;
+                    }
+                } else if (diff < 0) {
+                    return false; // full
+                } else {
+                    pos = m_enqueuePos.load(std::memory_order_relaxed);
+                }
             }
+            cell->m_slot = _slot;
+            cell->m_seq.store(pos + 1, std::memory_order_release);
             
-            sem_t *outQueueSem = sem_open(outQueueSemName, O_CREAT, 0600, 0);
-            if (outQueueSem == SEM_FAILED) {
-                elog(LOG, "MYSTEM: inOutQueue(2) init error = %d, %s", errno, strerror(errno));
-                return false;
+            return true;
+        }
+        
+        bool empty() const {
+            return m_enqueuePos.load() == m_dequeuePos.load();
+        }
+        
+        // number of queued slots, approximate while the ring is in use
+        uint64_t count() const {
+            uint64_t dequeuePos = m_dequeuePos.load();
+            uint64_t enqueuePos = m_enqueuePos.load();
+            return enqueuePos > dequeuePos ? enqueuePos - dequeuePos : 0;
+        }
+        
+        bool pop(uint32_t &_slot) {
+            cell_t *cell;
+            uint64_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+            while (true) {
+                cell = &cells()[pos & m_mask];
+                uint64_t seq = cell->m_seq.load(std::memory_order_acquire);
+                int64_t diff = static_cast<int64_t>(seq) - static_cast<int64_t>(pos + 1);
+                if (diff == 0) {
+                    if (m_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        break;
+                    }
+                } else if (diff < 0) {
+                    return false; // empty
+                } else {
+                    pos = m_dequeuePos.load(std::memory_order_relaxed);
+                }
             }
+            _slot = cell->m_slot;
+            cell->m_seq.store(pos + m_mask + 1, std::memory_order_release);
             
-            int inQueueShm = shm_open(inQueueShmName, O_CREAT | O_RDWR, 0600);
-            if (inQueueShm == -1) {
-                elog(LOG, "MYSTEM: inOutQueue(3) init error = %d, %s", errno, strerror(errno));
-                return false;
+            return true;
+        }
+    };
+    
+    // Shared memory arena for documents and results.
+    // The arena is split into fixed-size blocks, a payload is a chain of blocks, so the memory in use follows
+    // the bytes actually in flight. Free blocks are kept in a lock-free stack with an ABA tag in the high half
+    // of its head. The arena header is followed by the block links and then by the block data.
+    template <uint32_t blockBytes>
+    class blockArena_t {
+    public:
+        static const uint32_t blockSize = blockBytes;
+        static const uint32_t noBlock = 0xFFFFFFFF;
+        
+    private:
+        uint32_t m_blocks;
+        std::atomic<uint32_t> m_freeBlocks;
+        std::atomic<uint64_t> m_freeHead;
+        
+        static std::size_t headerSize() {
+            return CACHELINEALIGN(sizeof(blockArena_t));
+        }
+        
+        static std::size_t linksSize(uint32_t _blocks) {
+            return CACHELINEALIGN(sizeof(std::atomic<uint32_t>) * _blocks);
+        }
+        
+        std::atomic<uint32_t> *links() {
+            return reinterpret_cast<std::atomic<uint32_t> *>(reinterpret_cast<char *>(this) + headerSize());
+        }
+        
+        char *block(uint32_t _block) {
+            return reinterpret_cast<char *>(this) + headerSize() + linksSize(m_blocks) +
+                   static_cast<std::size_t>(_block) * blockSize;
+        }
+        
+        uint32_t popBlock() {
+            uint64_t head = m_freeHead.load(std::memory_order_acquire);
+            while (true) {
+                uint32_t first = static_cast<uint32_t>(head);
+                if (first == noBlock) {
+                    // blocks are reserved before popping, so the stack is empty only until
+                    // a concurrent release finishes
+                    head = m_freeHead.load(std::memory_order_acquire);
+                    continue;
+                }
+                uint64_t next = (((head >> 32) + 1) << 32) | links()[first].load(std::memory_order_relaxed);
+                if (m_freeHead.compare_exchange_weak(head, next, std::memory_order_acq_rel)) {
+                    return first;
+                }
             }
-            
-            int outQueueShm = shm_open(outQueueShmName, (O_CREAT | O_RDWR), 0600);
-            if (outQueueShm == -1) {
-                elog(LOG, "MYSTEM: inOutQueue(4) init error = %d, %s", errno, strerror(errno));
-                return false;
+        }
+        
+    public:
+        static uint32_t blocksFor(std::size_t _length) {
+            return static_cast<uint32_t>((_length + blockSize - 1) / blockSize);
+        }
+        
+        static std::size_t size(std::size_t _bytes) {
+            uint32_t blocks = blocksFor(_bytes);
+            return headerSize() + linksSize(blocks) + static_cast<std::size_t>(blocks) * blockSize;
+        }
+        
+        void init(std::size_t _bytes) {
+            m_blocks = blocksFor(_bytes);
+            for (uint32_t i = 0; i < m_blocks; ++i) {
+                new (&links()[i]) std::atomic<uint32_t>(i + 1 < m_blocks ? i + 1 : noBlock);
             }
-            
-            if (ftruncate(inQueueShm, (off_t) sizeof(inQueueRecord_t) * queueRecordsMax) != 0) {
-                elog(LOG, "MYSTEM: inOutQueue(5) init error = %d, %s", errno, strerror(errno));
+            new (&m_freeHead) std::atomic<uint64_t>(m_blocks > 0 ? 0 : noBlock);
+            new (&m_freeBlocks) std::atomic<uint32_t>(m_blocks);
+        }
+        
+        uint32_t blocks() const {
+            return m_blocks;
+        }
+        
+        // allocates a chain for _length bytes leaving at least _reserve blocks free,
+        // returns false if there is no room at the moment
+        bool allocate(std::size_t _length, uint32_t _reserve, uint32_t &_head) {
+            uint32_t blocks = blocksFor(_length);
+            _head = noBlock;
+            if (blocks == 0) {
+                return true;
             }
             
-            if (ftruncate(outQueueShm, (off_t) sizeof(outQueueRecord_t) * queueRecordsMax) != 0) {
-                elog(LOG, "MYSTEM: inOutQueue(6) init error = %d, %s", errno, strerror(errno));
-            }
+            uint32_t freeBlocks = m_freeBlocks.load();
+            do {
+                if (freeBlocks < blocks + _reserve) {
+                    return false;
+                }
+            } while (!m_freeBlocks.compare_exchange_weak(freeBlocks, freeBlocks - blocks));
             
-            inQueueRecord_t *inQueue = (inQueueRecord_t *) mmap((void *) 0, sizeof(inQueueRecord_t) * queueRecordsMax,
-                                                                PROT_WRITE, MAP_SHARED, inQueueShm, (off_t) 0);
-            if (inQueue == MAP_FAILED) {
-                elog(LOG, "MYSTEM: inOutQueue(7) init error = %d, %s", errno, strerror(errno));
-                return false;
-            }
-            outQueueRecord_t *outQueue = (outQueueRecord_t *) mmap((void *) 0, sizeof(outQueueRecord_t) * queueRecordsMax,
-                                                                   PROT_WRITE, MAP_SHARED, outQueueShm, (off_t) 0);
-            if (outQueue == MAP_FAILED) {
-                elog(LOG, "MYSTEM: inOutQueue(8) init error = %d, %s", errno, strerror(errno));
-                return false;
+            uint32_t last = noBlock;
+            for (uint32_t i = 0; i < blocks; ++i) {
+                uint32_t curr = popBlock();
+                links()[curr].store(noBlock, std::memory_order_relaxed);
+                if (last == noBlock) {
+                    _head = curr;
+                } else {
+                    links()[last].store(curr, std::memory_order_relaxed);
+                }
+                last = curr;
             }
             
-            bzero((void *) inQueue, sizeof(inQueueRecord_t) * queueRecordsMax);
-            bzero((void *) outQueue, sizeof(outQueueRecord_t) * queueRecordsMax);
-            
-            munmap((void *) inQueue, sizeof(inQueueRecord_t) * queueRecordsMax);
-            close(inQueueShm);
-            sem_post(inQueueSem);
-            
-            munmap((void *) outQueue, sizeof(outQueueRecord_t) * queueRecordsMax);
-            close(outQueueShm);
-            sem_post(outQueueSem);
-            
             return true;
         }
         
-        static void release() {
-            sem_unlink(inQueueSemName);
-            shm_unlink(inQueueShmName);
-            
-            sem_unlink(outQueueSemName);
-            shm_unlink(outQueueShmName);
-        }
-        
-        inOutQueue_t(): m_inQueueSem(SEM_FAILED), m_outQueueSem(SEM_FAILED), m_inQueueShm(-1), m_outQueueShm(-1),
-        m_inQueue(nullptr), m_outQueue(nullptr), m_OK(false), m_errCode(0) {
-            m_inQueueSem = sem_open(inQueueSemName, 0);
-            if (m_inQueueSem == SEM_FAILED) {
-                m_errCode = errno;
+        // returns the whole chain to the free stack with a single CAS
+        void release(uint32_t _head) {
+            if (_head == noBlock) {
                 return;
             }
             
-            m_outQueueSem = sem_open(outQueueSemName, 0);
-            if (m_outQueueSem == SEM_FAILED) {
-                m_errCode = errno;
-                return;
+            uint32_t blocks = 1;
+            uint32_t last = _head;
+            for (uint32_t next = links()[last].load(std::memory_order_relaxed); next != noBlock;
+                 next = links()[last].load(std::memory_order_relaxed)) {
+                last = next;
+                ++blocks;
             }
             
-            m_inQueueShm = shm_open(inQueueShmName, O_RDWR, 0600);
-            if (m_inQueueShm == -1) {
-                m_errCode = errno;
-                return;
+            uint64_t head = m_freeHead.load(std::memory_order_acquire);
+            do {
+                links()[last].store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+            } while (!m_freeHead.compare_exchange_weak(head, (((head >> 32) + 1) << 32) | _head,
+                                                       std::memory_order_acq_rel));
+            m_freeBlocks.fetch_add(blocks);
+        }
+        
+        // copies _length bytes into the chain starting from the _offset byte
+        void write(uint32_t _head, std::size_t _offset, const char *_data, std::size_t _length) {
+            uint32_t curr = _head;
+            for (; _offset >= blockSize; _offset -= blockSize) {
+                curr = links()[curr].load(std::memory_order_relaxed);
             }
-            
-            m_outQueueShm = shm_open(outQueueShmName, O_RDWR, 0600);
-            if (m_outQueueShm == -1) {
-                m_errCode = errno;
-                return;
+            while (_length > 0) {
+                std::size_t part = std::min(_length, static_cast<std::size_t>(blockSize - _offset));
+                memcpy(block(curr) + _offset, _data, part);
+                _data += part;
+                _length -= part;
+                _offset = 0;
+                curr = links()[curr].load(std::memory_order_relaxed);
             }
-            
-            m_inQueue = (inQueueRecord_t *) mmap((void *) 0, sizeof(inQueueRecord_t) * queueRecordsMax,
-                                                 PROT_WRITE, MAP_SHARED, m_inQueueShm, (off_t) 0);
-            if (m_inQueue == MAP_FAILED) {
-                m_errCode = errno;
+        }
+        
+        // appends _length bytes of the chain to _text
+        void read(uint32_t _head, std::size_t _length, std::string &_text) {
+            _text.reserve(_text.length() + _length);
+            for (uint32_t curr = _head; _length > 0; curr = links()[curr].load(std::memory_order_relaxed)) {
+                std::size_t part = std::min(_length, static_cast<std::size_t>(blockSize));
+                _text.append(block(curr), part);
+                _length -= part;
+            }
+        }
+        
+        // copies _length bytes of the chain to _data
+        void read(uint32_t _head, std::size_t _length, char *_data) {
+            for (uint32_t curr = _head; _length > 0; curr = links()[curr].load(std::memory_order_relaxed)) {
+                std::size_t part = std::min(_length, static_cast<std::size_t>(blockSize));
+                memcpy(_data, block(curr), part);
+                _data += part;
+                _length -= part;
+            }
+        }
+    };
+    
+    template <uint32_t blockBytes>
+    const uint32_t blockArena_t<blockBytes>::blockSize;
+    template <uint32_t blockBytes>
+    const uint32_t blockArena_t<blockBytes>::noBlock;
+    
+    // documents and results in flight
+    typedef blockArena_t<512> payloadArena_t;
+    
+    // microseconds from _start to _stop
+    static inline uint64_t elapsedUsecs(TimestampTz _start, TimestampTz _stop) {
+        long secs = 0;
+        int usecs = 0;
+        TimestampDifference(_start, _stop, &secs, &usecs);
+        return static_cast<uint64_t>(secs) * 1000000 + usecs;
+    }
+    
+    // Shared memory statistics of the extension: per worker counters, split documents and
+    // log2 latency histograms of the request stages. Counters are updated with relaxed atomics,
+    // readers see a consistent enough picture without locking.
+    class mystemStats_t {
+    public:
+        enum stage_t {
+            STAGE_QUEUE_WAIT = 0, // submitted -> taken by a worker
+            STAGE_PIPE_WRITE, // taken -> written to mystem
+            STAGE_MYSTEM, // written -> mystem output available
+            STAGE_PARSE, // JSON output parsing
+            STAGE_COPY_BACK, // result posted -> picked up by the backend
+            STAGES_NO
+        };
+        static const char *stageNames[STAGES_NO];
+        
+        // bucket i counts latencies below 2^i microseconds, the last one counts the rest
+        static const uint32_t buckets = 32;
+        
+        struct worker_t {
+            std::atomic<int32_t> m_pid; // 0 - not running
+            std::atomic<uint64_t> m_documents;
+            std::atomic<uint64_t> m_bytes;
+            std::atomic<uint64_t> m_busyTime; // microseconds
+            std::atomic<uint64_t> m_idleTime;
+            std::atomic<uint64_t> m_restarts;
+        };
+        
+    private:
+        static const char *shmName;
+        static mystemStats_t *m_attached;
+        
+        uint32_t m_workers;
+        std::atomic<uint64_t> m_split;
+        std::atomic<uint64_t> m_latency[STAGES_NO][buckets];
+        
+        static std::size_t headerSize() {
+            return CACHELINEALIGN(sizeof(mystemStats_t));
+        }
+        
+        worker_t *workers() {
+            return reinterpret_cast<worker_t *>(reinterpret_cast<char *>(this) + headerSize());
+        }
+        
+    public:
+        static std::size_t size() {
+            return headerSize() + sizeof(worker_t) * maxWorkers;
+        }
+        
+        // called by postmaster from the shmem_startup_hook
+        static void init() {
+            bool found = false;
+            mystemStats_t *stats = static_cast<mystemStats_t *>(ShmemInitStruct(shmName, size(), &found));
+            if (found) {
                 return;
             }
             
-            m_outQueue = (outQueueRecord_t *) mmap((void *) 0, sizeof(outQueueRecord_t) * queueRecordsMax,
-                                                   PROT_WRITE, MAP_SHARED, m_outQueueShm, (off_t) 0);
-            if (m_outQueue == MAP_FAILED) {
-                m_errCode = errno;
-                return;
+            stats->m_workers = maxWorkers;
+            new (&stats->m_split) std::atomic<uint64_t>(0);
+            for (uint32_t i = 0; i < STAGES_NO; ++i) {
+                for (uint32_t j = 0; j < buckets; ++j) {
+                    new (&stats->m_latency[i][j]) std::atomic<uint64_t>(0);
+                }
+            }
+            for (uint32_t i = 0; i < stats->m_workers; ++i) {
+                worker_t &worker = stats->workers()[i];
+                new (&worker.m_pid) std::atomic<int32_t>(0);
+                new (&worker.m_documents) std::atomic<uint64_t>(0);
+                new (&worker.m_bytes) std::atomic<uint64_t>(0);
+                new (&worker.m_busyTime) std::atomic<uint64_t>(0);
+                new (&worker.m_idleTime) std::atomic<uint64_t>(0);
+                new (&worker.m_restarts) std::atomic<uint64_t>(0);
+            }
+        }
+        
+        // returns statistics of the process or nullptr if the shared memory is not there
+        static mystemStats_t *attach() {
+            if (m_attached == nullptr) {
+                bool found = false;
+                mystemStats_t *stats = static_cast<mystemStats_t *>(ShmemInitStruct(shmName, size(), &found));
+                if (found) {
+                    m_attached = stats;
+                }
             }
             
-            m_OK = true;
+            return m_attached;
+        }
+        
+        uint32_t workersNo() const {
+            return m_workers;
+        }
+        
+        worker_t &worker(uint8_t _worker) {
+            return workers()[_worker];
         }
         
-        ~inOutQueue_t() {
-            if (m_inQueue != nullptr) {
-                munmap(m_inQueue, sizeof(inQueueRecord_t) * queueRecordsMax);
+        void addLatency(stage_t _stage, uint64_t _usecs) {
+            uint32_t bucket = 0;
+            while (bucket < buckets - 1 && (static_cast<uint64_t>(1) << bucket) <= _usecs) {
+                ++bucket;
             }
-            if (m_inQueueShm > 0) {
-                close(m_inQueueShm);
+            m_latency[_stage][bucket].fetch_add(1, std::memory_order_relaxed);
+        }
+        
+        uint64_t latency(uint32_t _stage, uint32_t _bucket) const {
+            return m_latency[_stage][_bucket].load(std::memory_order_relaxed);
+        }
+        
+        void countSplit() {
+            m_split.fetch_add(1, std::memory_order_relaxed);
+        }
+        
+        uint64_t split() const {
+            return m_split.load(std::memory_order_relaxed);
+        }
+        
+        // zeroes the counters, running workers keep their pids
+        void reset() {
+            m_split.store(0, std::memory_order_relaxed);
+            for (uint32_t i = 0; i < STAGES_NO; ++i) {
+                for (uint32_t j = 0; j < buckets; ++j) {
+                    m_latency[i][j].store(0, std::memory_order_relaxed);
+                }
             }
-            if (m_inQueueSem != SEM_FAILED) {
-                sem_close(m_inQueueSem);
+            for (uint32_t i = 0; i < m_workers; ++i) {
+                worker_t &worker = workers()[i];
+                worker.m_documents.store(0, std::memory_order_relaxed);
+                worker.m_bytes.store(0, std::memory_order_relaxed);
+                worker.m_busyTime.store(0, std::memory_order_relaxed);
+                worker.m_idleTime.store(0, std::memory_order_relaxed);
+                worker.m_restarts.store(0, std::memory_order_relaxed);
             }
+        }
+    };
+    
+    const char *mystemStats_t::stageNames[mystemStats_t::STAGES_NO] = {
+        "queue wait", "pipe write", "mystem", "parse", "copy back"
+    };
+    const char *mystemStats_t::shmName = "pg_mystem stats";
+    mystemStats_t *mystemStats_t::m_attached = nullptr;
+    
+    // Request queue placed into the PostgreSQL shared memory.
+    // Every request occupies one slot for its whole life, the slot index is the request ticket:
+    //   FREE -> SUBMITTED -> IN_PROGRESS -> DONE | FAILED -> FREE
+    // A document whose mystem died is submitted again (IN_PROGRESS -> SUBMITTED) or failed. A backend that gives
+    // up on a request marks it ABANDONED and the side holding the slot at the moment frees it.
+    // Free slots and submitted slots are passed around with lock-free rings, so neither backends
+    // nor mystem workers have to lock or scan the queue. Slots refer to documents and results stored
+    // in the payload arena.
+    class inOutQueue_t {
+    public:
+        enum slotState_t {
+            SLOT_FREE = 0,
+            SLOT_SUBMITTED,
+            SLOT_IN_PROGRESS,
+            SLOT_DONE,
+            SLOT_FAILED,
+            SLOT_ABANDONED
+        };
+        
+        // wait events of backends, reported as waits on LWLock tranches of these names
+        enum waitEvent_t {
+            WAIT_QUEUE_SLOT = 0,
+            WAIT_RESULT,
+            WAIT_EVENTS_NO
+        };
+        static const char *waitEventNames[WAIT_EVENTS_NO];
+        
+        enum lane_t {
+            LANE_INTERACTIVE = 0,
+            LANE_BULK,
+            LANES_NO
+        };
+        
+        static const uint8_t noWorker = 0xFF;
+        static const uint8_t attemptsMax = 2; // a document that mystem died on twice fails
+        
+        // the record refers to a document while it is submitted and to its result when it is done
+        struct queueRecord_t {
+            std::atomic<uint32_t> m_state;
+            uint32_t m_length;
+            uint32_t m_payload; // first arena block
+            Latch *m_ownerLatch; // submitter's latch, set when the result is ready
+            TimestampTz m_submitTime;
+            TimestampTz m_doneTime;
+            uint8_t m_worker; // worker processing the document
+            uint8_t m_attempts;
+            uint8_t m_kind; // requestKind_t
+            uint8_t m_lane;
+            int32_t m_ownerPid; // submitter, its documents are reclaimed if it exits without picking them up
+            uint32_t m_generation; // incremented by every submission, the ticket carries it
+        };
+        
+        // mystem worker advertises its latch and sleeps on it while it has room for more documents,
+        // a retiring worker finishes its documents and exits
+        struct workerRecord_t {
+            std::atomic<Latch *> m_latch;
+            std::atomic<bool> m_idle;
+            std::atomic<bool> m_retire;
+        };
+        
+    private:
+        static const char *shmName;
+        
+        // the header is followed by the records, the rings, the worker records and the arena,
+        // their sizes are fixed by the postmaster level settings
+        struct shared_t {
+            uint32_t m_records;
+            uint32_t m_workers;
+            uint32_t m_procs;
+            std::atomic<uint64_t> m_taken; // documents taken by workers
+            std::atomic<uint64_t> m_waitTime; // time they spent in the queue, microseconds
+            uint16_t m_waitEvents[WAIT_EVENTS_NO]; // tranche ids
+            std::atomic<int64_t> m_bulkServed; // last time a worker took a bulk document or the lane got one
             
-            if (m_outQueue != nullptr) {
-                munmap(m_outQueue, sizeof(outQueueRecord_t) * queueRecordsMax);
+            queueRecord_t *records() {
+                return reinterpret_cast<queueRecord_t *>(reinterpret_cast<char *>(this) + recordsOffset());
+            }
+            workerRecord_t *workers() {
+                return reinterpret_cast<workerRecord_t *>(reinterpret_cast<char *>(this) + workersOffset(m_records));
+            }
+            slotRing_t *waitRing() {
+                return reinterpret_cast<slotRing_t *>(reinterpret_cast<char *>(this) +
+                                                      waitRingOffset(m_records, m_workers));
+            }
+            // set while the process with this pgprocno is in the wait ring, so it is queued once
+            std::atomic<bool> *slotWaiting() {
+                return reinterpret_cast<std::atomic<bool> *>(reinterpret_cast<char *>(this) +
+                                                             slotWaitingOffset(m_records, m_workers));
             }
-            if (m_outQueueShm > 0) {
-                close(m_outQueueShm);
+            payloadArena_t *arena() {
+                return reinterpret_cast<payloadArena_t *>(reinterpret_cast<char *>(this) +
+                                                          arenaOffset(m_records, m_workers, m_procs));
             }
-            if (m_outQueueSem != SEM_FAILED) {
-                sem_close(m_outQueueSem);
+            slotRing_t *freeRing() {
+                return reinterpret_cast<slotRing_t *>(reinterpret_cast<char *>(this) + freeRingOffset(m_records));
             }
+            slotRing_t *inRing(uint32_t _lane) {
+                return reinterpret_cast<slotRing_t *>(reinterpret_cast<char *>(this) + inRingOffset(m_records) +
+                                                      _lane * CACHELINEALIGN(slotRing_t::size(m_records)));
+            }
+        };
+        
+        // every worker may have a full pipeline in progress and as many documents waiting for it
+        static uint32_t recordsNo() {
+            return static_cast<uint32_t>(maxWorkers * pipelineDepth * 2);
         }
         
-        bool isOK() const {
-            return m_OK;
+        static std::size_t recordsOffset() {
+            return CACHELINEALIGN(sizeof(shared_t));
+        }
+        static std::size_t freeRingOffset(uint32_t _records) {
+            return recordsOffset() + CACHELINEALIGN(sizeof(queueRecord_t) * _records);
+        }
+        static std::size_t inRingOffset(uint32_t _records) {
+            return freeRingOffset(_records) + CACHELINEALIGN(slotRing_t::size(_records));
+        }
+        static std::size_t workersOffset(uint32_t _records) {
+            return inRingOffset(_records) + LANES_NO * CACHELINEALIGN(slotRing_t::size(_records));
+        }
+        static std::size_t waitRingOffset(uint32_t _records, uint32_t _workers) {
+            return workersOffset(_records) + CACHELINEALIGN(sizeof(workerRecord_t) * _workers);
+        }
+        static std::size_t slotWaitingOffset(uint32_t _records, uint32_t _workers) {
+            return waitRingOffset(_records, _workers) + CACHELINEALIGN(slotRing_t::size(slotWaitersMax));
+        }
+        static std::size_t arenaOffset(uint32_t _records, uint32_t _workers, uint32_t _procs) {
+            return slotWaitingOffset(_records, _workers) + CACHELINEALIGN(sizeof(std::atomic<bool>) * _procs);
         }
         
-        int errCode() const {
-            return m_errCode;
+        // every PGPROC may wait for a slot: backends, background and auxiliary processes, prepared transactions
+        static uint32_t procsNo() {
+            return static_cast<uint32_t>(MaxConnections + autovacuum_max_workers + 1 + max_worker_processes +
+                                         max_prepared_xacts + NUM_AUXILIARY_PROCS);
         }
         
-        uint64_t setInQueueRecord(const std::string &_text) {
-            uint64_t ret = 0;
-            if (sem_trywait(m_inQueueSem) == 0) {
-                for (auto i = 0; i < queueRecordsMax; ++i) {
-                    if (m_inQueue[i].m_id == 0) {
-                        std::random_device rd;
-                        std::mt19937 gen(rd());
-                        std::uniform_int_distribution<> dis(1, std::numeric_limits<int>::max());
-                        ret = m_inQueue[i].m_id = dis(gen);
-                        
-                        std::string text = _text;
-                        if (text.length() > docLengthMax) {
-                            const char delimChars[] = " .,!@#$%^&*()_-+={[}];:'\"~`<>?/\n\t";
-                            std::size_t pos = text.find_last_of(delimChars, docLengthMax - 1, 1);
-                            if (pos == std::string::npos) {
-                                pos = docLengthMax - 1;
-                            }
-                            text = text.substr(0, pos + 1);
-                        }
-                        strncpy(m_inQueue[i].m_text,
-                                (text + " " + mystemParagraphEndMarker + "\n").c_str(),
-                                docAndPostfixLengthMax - 1);
-                        break;
-                    }
+        // documents may take up to 3/4 of the arena, the rest is kept for results
+        static uint32_t inputReserve(payloadArena_t *_arena) {
+            return _arena->blocks() / 4;
+        }
+        
+        shared_t *m_shared;
+        
+        bool m_OK;
+        
+        static bool servesLane(uint32_t _worker, uint32_t _lane) {
+            return _lane == LANE_INTERACTIVE || _worker >= static_cast<uint32_t>(reservedWorkers());
+        }
+        
+        // pops the next submitted document of the lane, abandoned documents are dropped on the way
+        bool popSubmitted(uint32_t _lane, uint32_t &_slot) {
+            while (m_shared->inRing(_lane)->pop(_slot)) {
+                uint32_t state = SLOT_SUBMITTED;
+                if (m_shared->records()[_slot].m_state.compare_exchange_strong(state, SLOT_IN_PROGRESS,
+                                                                               std::memory_order_acquire)) {
+                    return true;
                 }
-                sem_post(m_inQueueSem);
+                freeSlot(_slot);
             }
             
-            return ret;
+            return false;
         }
         
-        uint64_t getInQueueRecord(std::string &_text) {
-            uint64_t ret = 0;
-            if (sem_trywait(m_inQueueSem) == 0) {
-                for (auto i = 0; i < queueRecordsMax; ++i) {
-                    if (m_inQueue[i].m_id != 0) {
-                        ret = m_inQueue[i].m_id;
-                        m_inQueue[i].m_id = 0;
-                        _text = m_inQueue[i].m_text;
-                        bzero((void *) m_inQueue[i].m_text, docAndPostfixLengthMax);
-                        break;
-                    }
-                }
-                sem_post(m_inQueueSem);
+        void pushSubmitted(uint32_t _slot) {
+            uint32_t lane = m_shared->records()[_slot].m_lane;
+            if (lane == LANE_BULK && m_shared->inRing(lane)->empty()) {
+                m_shared->m_bulkServed.store(GetCurrentTimestamp(), std::memory_order_relaxed);
             }
-            
-            return ret;
+            m_shared->inRing(lane)->push(_slot);
+            wakeWorker(lane);
         }
         
-        bool setOutQueueRecord(uint64_t _id, const std::string &_text) {
-            bool ret = false;
-            if (sem_trywait(m_outQueueSem) == 0) {
-                for (auto i = 0; i < queueRecordsMax; ++i) {
-                    if (m_outQueue[i].m_id == 0) {
-                        m_outQueue[i].m_id = _id;
-                        std::string text = _text;
-                        if (text.length() > docAndPostfixLengthMax - 2) {
-                            text = text.substr(0, docAndPostfixLengthMax - 2);
-                        }
-                        strncpy(m_outQueue[i].m_text,
-                                (text + "\n").c_str(),
-                                docAndPostfixLengthMax - 1);
-                        ret = true;
-                        break;
+        // wakes up one of the idle workers serving the lane, if any, after a document was submitted
+        void wakeWorker(uint32_t _lane) {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            for (uint32_t i = 0; i < m_shared->m_workers; ++i) {
+                if (!servesLane(i, _lane)) {
+                    continue;
+                }
+                workerRecord_t &worker = m_shared->workers()[i];
+                bool idle = true;
+                if (worker.m_idle.compare_exchange_strong(idle, false)) {
+                    Latch *latch = worker.m_latch.load();
+                    if (latch != nullptr) {
+                        SetLatch(latch);
                     }
+                    break;
                 }
-                sem_post(m_outQueueSem);
             }
-            
-            return ret;
         }
         
-        bool getOutQueueRecord(uint64_t _id, std::string &_text) {
-            bool ret = false;
-            if (sem_trywait(m_outQueueSem) == 0) {
-                for (auto i = 0; i < queueRecordsMax; ++i) {
-                    if (m_outQueue[i].m_id == _id) {
-                        m_outQueue[i].m_id = 0;
-                        _text = m_outQueue[i].m_text;
-                        bzero((void *) m_outQueue[i].m_text, docAndPostfixLengthMax);
-                        ret = true;
-                        break;
+        // wakes up one of the backends waiting for a free slot, if any
+        void wakeSlotWaiter() {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            uint32_t procNo = 0;
+            if (m_shared->waitRing()->pop(procNo)) {
+                m_shared->slotWaiting()[procNo].store(false);
+                SetLatch(&ProcGlobal->allProcs[procNo].procLatch);
+            }
+        }
+        
+        // ticket: generation of the slot in the high half, slot number + 1 in the low one
+        uint64_t ticket(uint32_t _slot) const {
+            return (static_cast<uint64_t>(m_shared->records()[_slot].m_generation) << 32) | (_slot + 1);
+        }
+        
+        static uint32_t slotOf(uint64_t _id) {
+            return static_cast<uint32_t>(_id & 0xFFFFFFFF) - 1;
+        }
+        
+        bool ownsSlot(uint64_t _id) const {
+            return m_shared->records()[slotOf(_id)].m_generation == static_cast<uint32_t>(_id >> 32);
+        }
+        
+        // moves the slot to the abandoned state, so whoever holds it frees it, or frees it at once
+        // if it is processed already; only one of concurrent callers frees the slot
+        void abandonSlot(uint32_t _slot) {
+            queueRecord_t &record = m_shared->records()[_slot];
+            uint32_t state = record.m_state.load(std::memory_order_acquire);
+            while (state == SLOT_SUBMITTED || state == SLOT_IN_PROGRESS || state == SLOT_DONE || state == SLOT_FAILED) {
+                uint32_t prev = state;
+                if (record.m_state.compare_exchange_weak(state, SLOT_ABANDONED, std::memory_order_acq_rel)) {
+                    if (prev == SLOT_DONE || prev == SLOT_FAILED) {
+                        freeSlot(_slot);
                     }
+                    return;
                 }
-                sem_post(m_outQueueSem);
             }
-            
-            return ret;
         }
         
-    private:
+        // releases the payload of the slot and returns the slot to the free ring
+        void freeSlot(uint32_t _slot) {
+            queueRecord_t &record = m_shared->records()[_slot];
+            m_shared->arena()->release(record.m_payload);
+            record.m_payload = payloadArena_t::noBlock;
+            record.m_state.store(SLOT_FREE, std::memory_order_release);
+            m_shared->freeRing()->push(_slot);
+            wakeSlotWaiter();
+        }
         
-    };
-    
-    const uint16_t inOutQueue_t::queueRecordsMax = mystemProcNo * 2;
-    const char *inOutQueue_t::inQueueSemName = "/pg_mystemInQueueSem";
-    const char *inOutQueue_t::inQueueShmName = "/pg_mystemInQueueShm";
-    const char *inOutQueue_t::outQueueSemName = "/pg_mystemOutQueueSem";
-    const char *inOutQueue_t::outQueueShmName = "/pg_mystemOutQueueShm";
-}
-
-extern "C" {
-    static volatile sig_atomic_t mystemTerminated = false;
-    
-    static void mystemSigterm(SIGNAL_ARGS) {
-        int save_errno = errno;
-        mystemTerminated = true;
-        SetLatch(MyLatch);
-        errno = save_errno;
-    }
-    
-    #ifndef SHARE_FOLDER
+        // finishes processing of the slot, the slot is freed if its owner has abandoned it
+        void finishSlot(uint32_t _slot, slotState_t _state) {
+            queueRecord_t &record = m_shared->records()[_slot];
+            uint32_t state = SLOT_IN_PROGRESS;
+            if (record.m_state.compare_exchange_strong(state, _state, std::memory_order_release)) {
+                SetLatch(record.m_ownerLatch);
+            } else {
+                freeSlot(_slot);
+            }
+        }
+        
+    public:
+        static std::size_t shmemSize() {
+            return arenaOffset(recordsNo(), maxWorkers, procsNo()) + payloadArena_t::size(queueMemory * 1024L);
+        }
+        
+        // called by postmaster from the shmem_startup_hook
+        static void init() {
+            bool found = false;
+            shared_t *shared = static_cast<shared_t *>(ShmemInitStruct(shmName, shmemSize(), &found));
+            if (found) {
+                return;
+            }
+            
+            shared->m_records = recordsNo();
+            shared->m_workers = maxWorkers;
+            shared->m_procs = procsNo();
+            new (&shared->m_taken) std::atomic<uint64_t>(0);
+            new (&shared->m_waitTime) std::atomic<uint64_t>(0);
+            new (&shared->m_bulkServed) std::atomic<int64_t>(0);
+            for (uint32_t i = 0; i < WAIT_EVENTS_NO; ++i) {
+                shared->m_waitEvents[i] = GetNamedLWLockTranche(waitEventNames[i])->lock.tranche;
+            }
+            shared->freeRing()->init(shared->m_records);
+            for (uint32_t i = 0; i < LANES_NO; ++i) {
+                shared->inRing(i)->init(shared->m_records);
+            }
+            shared->waitRing()->init(slotWaitersMax);
+            for (uint32_t i = 0; i < shared->m_procs; ++i) {
+                new (&shared->slotWaiting()[i]) std::atomic<bool>(false);
+            }
+            shared->arena()->init(queueMemory * 1024L);
+            for (uint32_t i = 0; i < shared->m_records; ++i) {
+                new (&shared->records()[i].m_state) std::atomic<uint32_t>(SLOT_FREE);
+                shared->records()[i].m_length = 0;
+                shared->records()[i].m_payload = payloadArena_t::noBlock;
+                shared->records()[i].m_ownerLatch = nullptr;
+                shared->records()[i].m_ownerPid = 0;
+                shared->records()[i].m_generation = 0;
+                shared->freeRing()->push(i);
+            }
+            for (uint32_t i = 0; i < shared->m_workers; ++i) {
+                new (&shared->workers()[i].m_latch) std::atomic<Latch *>(nullptr);
+                new (&shared->workers()[i].m_idle) std::atomic<bool>(false);
+                new (&shared->workers()[i].m_retire) std::atomic<bool>(false);
+            }
+        }
+        
+        inOutQueue_t(): m_shared(nullptr), m_OK(false) {
+            bool found = false;
+            m_shared = static_cast<shared_t *>(ShmemInitStruct(shmName, shmemSize(), &found));
+            m_OK = found;
+        }
+        
+        bool isOK() const {
+            return m_OK;
+        }
+        
+        void registerWorker(uint8_t _worker, Latch *_latch) {
+            m_shared->workers()[_worker].m_latch.store(_latch);
+        }
+        
+        // called by the worker on exit, nobody is going to set its latch any more
+        void unregisterWorker(uint8_t _worker) {
+            workerRecord_t &worker = m_shared->workers()[_worker];
+            worker.m_idle.store(false);
+            worker.m_latch.store(nullptr);
+        }
+        
+        // called by the launcher before it starts a worker in the place
+        void resetWorker(uint8_t _worker) {
+            workerRecord_t &worker = m_shared->workers()[_worker];
+            worker.m_idle.store(false);
+            worker.m_retire.store(false);
+            worker.m_latch.store(nullptr);
+        }
+        
+        void retireWorker(uint8_t _worker) {
+            workerRecord_t &worker = m_shared->workers()[_worker];
+            worker.m_retire.store(true);
+            Latch *latch = worker.m_latch.load();
+            if (latch != nullptr) {
+                SetLatch(latch);
+            }
+        }
+        
+        bool isRetiring(uint8_t _worker) {
+            return m_shared->workers()[_worker].m_retire.load();
+        }
+        
+        // documents waiting for a worker
+        uint64_t pending() const {
+            return m_shared->inRing(LANE_INTERACTIVE)->count() + m_shared->inRing(LANE_BULK)->count();
+        }
+        
+        // documents taken by workers so far and their total time in the queue
+        void waitStats(uint64_t &_taken, uint64_t &_waitTime) const {
+            _taken = m_shared->m_taken.load(std::memory_order_relaxed);
+            _waitTime = m_shared->m_waitTime.load(std::memory_order_relaxed);
+        }
+        
+        // worker advertises free room in its pipeline before the final queue check, so a submitter either
+        // finds the worker idle and sets its latch or the worker finds the submitted document,
+        // returns false if the queue is not empty and the worker should not sleep
+        bool setWorkerIdle(uint8_t _worker) {
+            workerRecord_t &worker = m_shared->workers()[_worker];
+            worker.m_idle.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!m_shared->inRing(LANE_INTERACTIVE)->empty() ||
+                (servesLane(_worker, LANE_BULK) && !m_shared->inRing(LANE_BULK)->empty())) {
+                worker.m_idle.store(false);
+                return false;
+            }
+            
+            return true;
+        }
+        
+        void setWorkerBusy(uint8_t _worker) {
+            m_shared->workers()[_worker].m_idle.store(false);
+        }
+        
+        // the wait event is shown in pg_stat_activity until reportWaitEnd()
+        void reportWaitStart(waitEvent_t _event) {
+            pgstat_report_wait_start(WAIT_LWLOCK_TRANCHE, m_shared->m_waitEvents[_event]);
+        }
+        
+        void reportWaitEnd() {
+            pgstat_report_wait_end();
+        }
+        
+        // registers the calling backend as waiting for a free slot unless it is queued already; a waiter may be
+        // woken up for a slot somebody else has taken or not registered at all if the wait ring is full,
+        // so it still has to poll with a timeout
+        void waitForSlot() {
+            uint32_t procNo = static_cast<uint32_t>(MyProc->pgprocno);
+            if (procNo < m_shared->m_procs && !m_shared->slotWaiting()[procNo].exchange(true)) {
+                if (!m_shared->waitRing()->push(procNo)) {
+                    m_shared->slotWaiting()[procNo].store(false);
+                }
+            }
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+        
+        // longest document passed to mystem at once, longer ones are split by the backend
+        std::size_t documentLengthMax() const {
+            payloadArena_t *arena = m_shared->arena();
+            return std::min(static_cast<std::size_t>(docLengthMax),
+                            static_cast<std::size_t>(arena->blocks() - inputReserve(arena)) * payloadArena_t::blockSize -
+                            docPostfixLength);
+        }
+        
+        // returns ticket of the submitted document or 0 if the queue is full,
+        // the document must not be longer than documentLengthMax()
+        uint64_t setInQueueRecord(const char *_text, std::size_t _length, requestKind_t _kind = REQUEST_TEXT,
+                                  lane_t _lane = LANE_INTERACTIVE) {
+            if (_length > documentLengthMax()) {
+                throw mystemError_t("document chunk does not fit the queue");
+            }
+            uint32_t slot = 0;
+            if (!m_shared->freeRing()->pop(slot)) {
+                return 0;
+            }
+            
+            queueRecord_t &record = m_shared->records()[slot];
+            payloadArena_t *arena = m_shared->arena();
+            static const char postfix[] = " EndOfArticleMarker\n";
+            static_assert(sizeof(postfix) == docPostfixLength, "postfix does not match docPostfixLength");
+            const std::size_t postfixLength = sizeof(postfix) - 1;
+            if (!arena->allocate(_length + postfixLength, inputReserve(arena), record.m_payload)) {
+                // no room for the document, wait as if the queue is full
+                m_shared->freeRing()->push(slot);
+                return 0;
+            }
+            arena->write(record.m_payload, 0, _text, _length);
+            arena->write(record.m_payload, _length, postfix, postfixLength);
+            record.m_length = _length + postfixLength;
+            record.m_ownerLatch = &MyProc->procLatch;
+            record.m_ownerPid = MyProcPid;
+            ++record.m_generation;
+            record.m_submitTime = GetCurrentTimestamp();
+            record.m_worker = noWorker;
+            record.m_attempts = 0;
+            record.m_kind = static_cast<uint8_t>(_kind);
+            record.m_lane = static_cast<uint8_t>(_lane);
+            record.m_state.store(SLOT_SUBMITTED, std::memory_order_release);
+            pushSubmitted(slot);
+            MYSTEM_PROBE2(enqueue, slot + 1, record.m_length);
+            
+            return ticket(slot);
+        }
+        
+        // returns ticket of the next submitted document or 0 if there is nothing to do,
+        // the document is moved out of the arena; the interactive lane goes first unless the bulk lane
+        // has waited for bulkAgingTime, reserved workers take interactive documents only
+        uint64_t getInQueueRecord(uint8_t _worker, std::string &_text, requestKind_t &_kind) {
+            uint32_t slot = 0;
+            if (!servesLane(_worker, LANE_BULK)) {
+                if (!popSubmitted(LANE_INTERACTIVE, slot)) {
+                    return 0;
+                }
+            } else {
+                TimestampTz now = GetCurrentTimestamp();
+                bool aged = !m_shared->inRing(LANE_BULK)->empty() &&
+                            TimestampDifferenceExceeds(m_shared->m_bulkServed.load(std::memory_order_relaxed), now,
+                                                       bulkAgingTime);
+                uint32_t first = aged ? LANE_BULK : LANE_INTERACTIVE;
+                uint32_t second = aged ? LANE_INTERACTIVE : LANE_BULK;
+                uint32_t lane = first;
+                if (!popSubmitted(first, slot)) {
+                    lane = second;
+                    if (!popSubmitted(second, slot)) {
+                        return 0;
+                    }
+                }
+                if (lane == LANE_BULK) {
+                    m_shared->m_bulkServed.store(now, std::memory_order_relaxed);
+                }
+            }
+            
+            queueRecord_t &record = m_shared->records()[slot];
+            record.m_worker = _worker;
+            _kind = static_cast<requestKind_t>(record.m_kind);
+            _text.clear();
+            m_shared->arena()->read(record.m_payload, record.m_length, _text);
+            m_shared->arena()->release(record.m_payload);
+            record.m_payload = payloadArena_t::noBlock;
+            
+            uint64_t waitTime = elapsedUsecs(record.m_submitTime, GetCurrentTimestamp());
+            m_shared->m_waitTime.fetch_add(waitTime, std::memory_order_relaxed);
+            m_shared->m_taken.fetch_add(1, std::memory_order_relaxed);
+            MYSTEM_PROBE2(dequeue, slot + 1, _worker);
+            mystemStats_t *stats = mystemStats_t::attach();
+            if (stats != nullptr) {
+                stats->addLatency(mystemStats_t::STAGE_QUEUE_WAIT, waitTime);
+            }
+            
+            return ticket(slot);
+        }
+        
+        // returns false if there is no room for the result at the moment,
+        // a result longer than the whole arena fails the document
+        bool setOutQueueRecord(uint64_t _id, const std::string &_text) {
+            queueRecord_t &record = m_shared->records()[slotOf(_id)];
+            payloadArena_t *arena = m_shared->arena();
+            std::size_t length = _text.length();
+            if (length + 1 > static_cast<std::size_t>(arena->blocks()) * payloadArena_t::blockSize) {
+                elog(LOG, "MYSTEM: result of %zu bytes does not fit the queue", length);
+                failOutQueueRecord(_id);
+                return true;
+            }
+            if (!arena->allocate(length + 1, 0, record.m_payload)) {
+                return false;
+            }
+            arena->write(record.m_payload, 0, _text.c_str(), length);
+            arena->write(record.m_payload, length, "\n", 1);
+            record.m_length = length + 1;
+            record.m_doneTime = GetCurrentTimestamp();
+            finishSlot(slotOf(_id), SLOT_DONE);
+            
+            return true;
+        }
+        
+        // reports that the document could not be processed
+        void failOutQueueRecord(uint64_t _id) {
+            finishSlot(slotOf(_id), SLOT_FAILED);
+        }
+        
+        // submits the document taken by a worker whose mystem died again, so another mystem process
+        // may take it; the document fails after attemptsMax attempts or if there is no room for it
+        void requeueRecord(uint64_t _id, const std::string &_text) {
+            queueRecord_t &record = m_shared->records()[slotOf(_id)];
+            payloadArena_t *arena = m_shared->arena();
+            if (++record.m_attempts >= attemptsMax ||
+                !arena->allocate(_text.length(), inputReserve(arena), record.m_payload)) {
+                failOutQueueRecord(_id);
+                return;
+            }
+            arena->write(record.m_payload, 0, _text.c_str(), _text.length());
+            record.m_length = _text.length();
+            record.m_worker = noWorker;
+            
+            uint32_t state = SLOT_IN_PROGRESS;
+            if (!record.m_state.compare_exchange_strong(state, SLOT_SUBMITTED, std::memory_order_release)) {
+                freeSlot(slotOf(_id));
+                return;
+            }
+            pushSubmitted(slotOf(_id));
+        }
+        
+        // fails documents left by a worker that has exited, called by the launcher
+        void reclaimWorkerRecords(uint8_t _worker) {
+            for (uint32_t i = 0; i < m_shared->m_records; ++i) {
+                queueRecord_t &record = m_shared->records()[i];
+                uint32_t state = record.m_state.load(std::memory_order_acquire);
+                if (record.m_worker != _worker || (state != SLOT_IN_PROGRESS && state != SLOT_ABANDONED)) {
+                    continue;
+                }
+                record.m_worker = noWorker;
+                finishSlot(i, SLOT_FAILED);
+            }
+        }
+        
+        // returns false while the document is not processed yet, _failed is set if mystem failed on it
+        bool getOutQueueRecord(uint64_t _id, std::string &_text, bool &_failed) {
+            if (!ownsSlot(_id)) {
+                // the slot was reclaimed and reused meanwhile
+                _text.clear();
+                _failed = true;
+                return true;
+            }
+            queueRecord_t &record = m_shared->records()[slotOf(_id)];
+            uint32_t state = record.m_state.load(std::memory_order_acquire);
+            if (state != SLOT_DONE && state != SLOT_FAILED) {
+                return false;
+            }
+            _text.clear();
+            _failed = (state == SLOT_FAILED);
+            MYSTEM_PROBE2(result__fetched, _id, _failed ? 0 : record.m_length);
+            if (!_failed) {
+                m_shared->arena()->read(record.m_payload, record.m_length, _text);
+                mystemStats_t *stats = mystemStats_t::attach();
+                if (stats != nullptr) {
+                    stats->addLatency(mystemStats_t::STAGE_COPY_BACK,
+                                      elapsedUsecs(record.m_doneTime, GetCurrentTimestamp()));
+                }
+            }
+            freeSlot(slotOf(_id));
+            
+            return true;
+        }
+        
+        // same as above, but the result is copied from the arena straight into a palloc'd text
+        bool getOutQueueRecord(uint64_t _id, text *&_result, bool &_failed) {
+            if (!ownsSlot(_id)) {
+                _result = nullptr;
+                _failed = true;
+                return true;
+            }
+            queueRecord_t &record = m_shared->records()[slotOf(_id)];
+            uint32_t state = record.m_state.load(std::memory_order_acquire);
+            if (state != SLOT_DONE && state != SLOT_FAILED) {
+                return false;
+            }
+            _result = nullptr;
+            _failed = (state == SLOT_FAILED);
+            MYSTEM_PROBE2(result__fetched, _id, _failed ? 0 : record.m_length);
+            if (!_failed) {
+                _result = static_cast<text *>(palloc_extended(VARHDRSZ + record.m_length, MCXT_ALLOC_NO_OOM));
+                if (_result == nullptr) {
+                    freeSlot(slotOf(_id));
+                    throw mystemError_t("out of memory");
+                }
+                SET_VARSIZE(_result, VARHDRSZ + record.m_length);
+                m_shared->arena()->read(record.m_payload, record.m_length, VARDATA(_result));
+                mystemStats_t *stats = mystemStats_t::attach();
+                if (stats != nullptr) {
+                    stats->addLatency(mystemStats_t::STAGE_COPY_BACK,
+                                      elapsedUsecs(record.m_doneTime, GetCurrentTimestamp()));
+                }
+            }
+            freeSlot(slotOf(_id));
+            
+            return true;
+        }
+        
+        // gives up on the request, the slot is freed by whoever holds it
+        void abandonRecord(uint64_t _id) {
+            if (ownsSlot(_id)) {
+                abandonSlot(slotOf(_id));
+            }
+        }
+        
+        // abandons documents of backends that have exited without picking their results up,
+        // called by the launcher, returns the number of reclaimed slots
+        uint32_t reclaimOrphans() {
+            uint32_t reclaimed = 0;
+            for (uint32_t i = 0; i < m_shared->m_records; ++i) {
+                queueRecord_t &record = m_shared->records()[i];
+                uint32_t state = record.m_state.load(std::memory_order_acquire);
+                if (state == SLOT_FREE || state == SLOT_ABANDONED || record.m_ownerPid == 0 ||
+                    BackendPidGetProc(record.m_ownerPid) != NULL) {
+                    continue;
+                }
+                abandonSlot(i);
+                ++reclaimed;
+            }
+            
+            return reclaimed;
+        }
+    };
+    
+    const char *inOutQueue_t::shmName = "pg_mystem queue";
+    const char *inOutQueue_t::waitEventNames[inOutQueue_t::WAIT_EVENTS_NO] = {"MystemQueueSlot", "MystemResult"};
+    
+    // counters of a shared cache
+    struct cacheStats_t {
+        uint64_t m_hits;
+        uint64_t m_misses;
+        uint64_t m_insertions;
+        uint64_t m_evictions;
+    };
+    
+    // Snapshot of the word cache in the data directory, so a restarted cluster starts with the learned words.
+    // The launcher writes it every pg_mystem.word_cache_snapshot_interval and on shutdown and bumps the snapshot
+    // generation in the shared cache. Workers map the snapshot read-only when they start, other processes on their
+    // first cache miss, and a process maps the file again when the generation has changed and the file with it;
+    // words found there are copied into the shared cache. The file is a header, an index of (hash, offset) pairs
+    // sorted by hash and the records, each record is the word length byte, the lemma length byte, the word and
+    // the lemma.
+    static int wordSnapshotInterval = 300; // seconds, 0 disables the snapshot
+    
+    class wordSnapshot_t {
+    public:
+        // word form -> lemma pair collected from the cache
+        struct pair_t {
+            uint32_t m_hash;
+            std::string m_word;
+            std::string m_lemma;
+        };
+        
+    private:
+        struct header_t {
+            char m_magic[8];
+            uint32_t m_version; // snapshots of other formats or PostgreSQL versions (hash_any) are ignored
+            uint32_t m_count;
+            uint64_t m_dataSize;
+        };
+        
+        struct index_t {
+            uint32_t m_hash;
+            uint32_t m_offset;
+        };
+        
+        static const char magic[8];
+        static const uint32_t version = (PG_VERSION_NUM / 100) * 100 + 1;
+        static const char *fileName;
+        
+        static bool m_checked;
+        static uint32_t m_generation; // generation the mapping was checked at
+        static const char *m_mapped;
+        static std::size_t m_size;
+        static struct stat m_stat; // of the mapped file
+        
+        static const header_t *header() {
+            return reinterpret_cast<const header_t *>(m_mapped);
+        }
+        
+        static const index_t *index() {
+            return reinterpret_cast<const index_t *>(m_mapped + sizeof(header_t));
+        }
+        
+        static const char *data() {
+            return m_mapped + sizeof(header_t) + sizeof(index_t) * header()->m_count;
+        }
+        
+        static bool valid(const char *_mapped, std::size_t _size) {
+            if (_size < sizeof(header_t)) {
+                return false;
+            }
+            const header_t *head = reinterpret_cast<const header_t *>(_mapped);
+            return memcmp(head->m_magic, magic, sizeof(magic)) == 0 && head->m_version == version &&
+                   _size == sizeof(header_t) + sizeof(index_t) * static_cast<std::size_t>(head->m_count) +
+                            head->m_dataSize;
+        }
+        
+        static bool writeAll(int _fd, const void *_data, std::size_t _length) {
+            const char *data = static_cast<const char *>(_data);
+            while (_length > 0) {
+                ssize_t written = write(_fd, data, _length);
+                if (written < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (written <= 0) {
+                    return false;
+                }
+                data += written;
+                _length -= static_cast<std::size_t>(written);
+            }
+            return true;
+        }
+        
+        static void unmap() {
+            if (m_mapped != nullptr) {
+                munmap(const_cast<char *>(m_mapped), m_size);
+                m_mapped = nullptr;
+                m_size = 0;
+            }
+        }
+        
+    public:
+        // maps the snapshot of the generation unless it is mapped already, a file that has not changed since
+        // it was mapped is kept
+        static bool attach(uint32_t _generation) {
+            if (m_checked && m_generation == _generation) {
+                return m_mapped != nullptr;
+            }
+            m_checked = true;
+            m_generation = _generation;
+            
+            int fd = open(fileName, O_RDONLY);
+            if (fd < 0) {
+                unmap();
+                return false;
+            }
+            struct stat st;
+            if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+                unmap();
+            } else if (m_mapped == nullptr || st.st_ino != m_stat.st_ino || st.st_size != m_stat.st_size ||
+                       st.st_mtime != m_stat.st_mtime) {
+                unmap();
+                void *mapped = mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+                if (mapped != MAP_FAILED) {
+                    if (valid(static_cast<const char *>(mapped), static_cast<std::size_t>(st.st_size))) {
+                        m_mapped = static_cast<const char *>(mapped);
+                        m_size = static_cast<std::size_t>(st.st_size);
+                        m_stat = st;
+                    } else {
+                        munmap(mapped, static_cast<std::size_t>(st.st_size));
+                        elog(LOG, "MYSTEM: ignoring invalid word cache snapshot \"%s\"", fileName);
+                    }
+                }
+            }
+            close(fd);
+            
+            return m_mapped != nullptr;
+        }
+        
+        static bool lookup(uint32_t _generation, uint32_t _hash, const char *_word, std::size_t _length,
+                           std::string &_lemma) {
+            if (wordSnapshotInterval == 0 || !attach(_generation)) {
+                return false;
+            }
+            
+            const index_t *begin = index();
+            const index_t *end = begin + header()->m_count;
+            const index_t *it = std::lower_bound(begin, end, _hash, [](const index_t &_entry, uint32_t _value) {
+                return _entry.m_hash < _value;
+            });
+            for (; it != end && it->m_hash == _hash; ++it) {
+                if (static_cast<uint64_t>(it->m_offset) + 2 > header()->m_dataSize) {
+                    break;
+                }
+                const unsigned char *record = reinterpret_cast<const unsigned char *>(data() + it->m_offset);
+                std::size_t wordLength = record[0];
+                std::size_t lemmaLength = record[1];
+                if (it->m_offset + 2 + wordLength + lemmaLength > header()->m_dataSize) {
+                    break;
+                }
+                if (wordLength == _length && memcmp(record + 2, _word, _length) == 0) {
+                    _lemma.assign(reinterpret_cast<const char *>(record) + 2 + wordLength, lemmaLength);
+                    return true;
+                }
+            }
+            
+            return false;
+        }
+        
+        // writes the pairs to a temporary file and renames it over the snapshot, called by the launcher
+        static bool save(std::vector<pair_t> &_pairs) {
+            std::sort(_pairs.begin(), _pairs.end(), [](const pair_t &_a, const pair_t &_b) {
+                return _a.m_hash < _b.m_hash;
+            });
+            std::vector<index_t> entries;
+            entries.reserve(_pairs.size());
+            std::string records;
+            for (auto &pair:_pairs) {
+                entries.push_back(index_t{pair.m_hash, static_cast<uint32_t>(records.length())});
+                records.push_back(static_cast<char>(pair.m_word.length()));
+                records.push_back(static_cast<char>(pair.m_lemma.length()));
+                records.append(pair.m_word);
+                records.append(pair.m_lemma);
+            }
+            header_t head;
+            memcpy(head.m_magic, magic, sizeof(magic));
+            head.m_version = version;
+            head.m_count = static_cast<uint32_t>(entries.size());
+            head.m_dataSize = records.length();
+            
+            std::string tempName = std::string(fileName) + ".tmp";
+            int fd = open(tempName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+            if (fd < 0) {
+                elog(LOG, "MYSTEM: could not create word cache snapshot, errno = %d", errno);
+                return false;
+            }
+            bool written = writeAll(fd, &head, sizeof(head)) &&
+                           writeAll(fd, entries.data(), sizeof(index_t) * entries.size()) &&
+                           writeAll(fd, records.data(), records.length()) && fsync(fd) == 0;
+            int error = errno;
+            close(fd);
+            if (!written || rename(tempName.c_str(), fileName) != 0) {
+                elog(LOG, "MYSTEM: could not write word cache snapshot, errno = %d", written ? errno : error);
+                unlink(tempName.c_str());
+                return false;
+            }
+            
+            return true;
+        }
+    };
+    
+    const char wordSnapshot_t::magic[8] = {'M', 'Y', 'S', 'T', 'W', 'O', 'R', 'D'};
+    const char *wordSnapshot_t::fileName = "pg_mystem_words.snapshot";
+    bool wordSnapshot_t::m_checked = false;
+    uint32_t wordSnapshot_t::m_generation = 0;
+    const char *wordSnapshot_t::m_mapped = nullptr;
+    std::size_t wordSnapshot_t::m_size = 0;
+    struct stat wordSnapshot_t::m_stat;
+    
+    // Shared memory cache of word form -> lemma pairs learned from the mystem output.
+    // It is a set-associative table, a word hashes to a set of wordCache_t::ways entries which are replaced
+    // with the CLOCK algorithm. Readers never lock, each entry is guarded by a version counter that is odd while
+    // the entry is being written (seqlock); writers of a set are serialized with a per-set spin flag.
+    class wordCache_t {
+    public:
+        static const uint32_t ways = 8;
+        static const std::size_t dataMax = 116; // word and lemma bytes
+        
+    private:
+        struct entry_t {
+            std::atomic<uint32_t> m_version;
+            uint32_t m_hash;
+            uint8_t m_wordLength; // 0 - empty entry
+            uint8_t m_lemmaLength;
+            std::atomic<uint8_t> m_referenced;
+            uint8_t m_reserved;
+            char m_data[dataMax]; // word followed by lemma
+        };
+        static_assert(sizeof(entry_t) == 128, "word cache entry must take two cache lines");
+        
+        struct set_t {
+            std::atomic<bool> m_locked;
+            uint8_t m_hand;
+        };
+        
+        static const char *shmName;
+        static wordCache_t *m_attached;
+        
+        uint32_t m_sets;
+        std::atomic<uint64_t> m_hits;
+        std::atomic<uint64_t> m_misses;
+        std::atomic<uint64_t> m_insertions;
+        std::atomic<uint64_t> m_evictions;
+        std::atomic<uint32_t> m_snapshotGeneration; // bumped by every saved snapshot
+        
+        static std::size_t headerSize() {
+            return CACHELINEALIGN(sizeof(wordCache_t));
+        }
+        
+        static uint32_t setsFor(std::size_t _bytes) {
+            return static_cast<uint32_t>(_bytes / (sizeof(entry_t) * ways + sizeof(set_t)));
+        }
+        
+        set_t *sets() {
+            return reinterpret_cast<set_t *>(reinterpret_cast<char *>(this) + headerSize());
+        }
+        
+        entry_t *entries() {
+            return reinterpret_cast<entry_t *>(reinterpret_cast<char *>(this) + headerSize() +
+                                               CACHELINEALIGN(sizeof(set_t) * m_sets));
+        }
+        
+        static uint32_t hash(const char *_word, std::size_t _length) {
+            return DatumGetUInt32(hash_any(reinterpret_cast<const unsigned char *>(_word), static_cast<int>(_length)));
+        }
+        
+    public:
+        static std::size_t size(std::size_t _bytes) {
+            uint32_t sets = setsFor(_bytes);
+            if (sets == 0) {
+                return 0;
+            }
+            return headerSize() + CACHELINEALIGN(sizeof(set_t) * sets) + sizeof(entry_t) * ways * sets;
+        }
+        
+        // called by postmaster from the shmem_startup_hook
+        static void init(std::size_t _bytes) {
+            if (size(_bytes) == 0) {
+                return;
+            }
+            
+            bool found = false;
+            wordCache_t *cache = static_cast<wordCache_t *>(ShmemInitStruct(shmName, size(_bytes), &found));
+            if (found) {
+                return;
+            }
+            
+            cache->m_sets = setsFor(_bytes);
+            new (&cache->m_hits) std::atomic<uint64_t>(0);
+            new (&cache->m_misses) std::atomic<uint64_t>(0);
+            new (&cache->m_insertions) std::atomic<uint64_t>(0);
+            new (&cache->m_evictions) std::atomic<uint64_t>(0);
+            new (&cache->m_snapshotGeneration) std::atomic<uint32_t>(0);
+            for (uint32_t i = 0; i < cache->m_sets; ++i) {
+                new (&cache->sets()[i].m_locked) std::atomic<bool>(false);
+                cache->sets()[i].m_hand = 0;
+            }
+            for (uint32_t i = 0; i < cache->m_sets * ways; ++i) {
+                entry_t &entry = cache->entries()[i];
+                new (&entry.m_version) std::atomic<uint32_t>(0);
+                new (&entry.m_referenced) std::atomic<uint8_t>(0);
+                entry.m_hash = 0;
+                entry.m_wordLength = 0;
+                entry.m_lemmaLength = 0;
+            }
+        }
+        
+        // returns the cache of the process or nullptr if the cache is disabled
+        static wordCache_t *attach(std::size_t _bytes) {
+            if (m_attached == nullptr && size(_bytes) > 0) {
+                bool found = false;
+                wordCache_t *cache = static_cast<wordCache_t *>(ShmemInitStruct(shmName, size(_bytes), &found));
+                if (found) {
+                    m_attached = cache;
+                }
+            }
+            
+            return m_attached;
+        }
+        
+    private:
+        // looks the word up in the shared table only; _reference marks a found entry as recently used
+        bool find(uint32_t _wordHash, const char *_word, std::size_t _length, std::string &_lemma, bool _reference) {
+            entry_t *set = entries() + static_cast<std::size_t>(_wordHash % m_sets) * ways;
+            char lemma[dataMax];
+            for (uint32_t i = 0; i < ways; ++i) {
+                entry_t &entry = set[i];
+                uint32_t version = entry.m_version.load(std::memory_order_acquire);
+                if ((version & 1) != 0 || entry.m_hash != _wordHash || entry.m_wordLength != _length) {
+                    continue;
+                }
+                std::size_t lemmaLength = std::min(static_cast<std::size_t>(entry.m_lemmaLength), dataMax - _length);
+                bool match = (memcmp(entry.m_data, _word, _length) == 0);
+                memcpy(lemma, entry.m_data + _length, lemmaLength);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (match && entry.m_version.load(std::memory_order_relaxed) == version) {
+                    if (_reference) {
+                        entry.m_referenced.store(1, std::memory_order_relaxed);
+                    }
+                    _lemma.assign(lemma, lemmaLength);
+                    return true;
+                }
+            }
+            
+            return false;
+        }
+        
+    public:
+        bool lookup(const char *_word, std::size_t _length, std::string &_lemma) {
+            if (_length == 0 || _length >= dataMax) {
+                return false;
+            }
+            
+            uint32_t wordHash = hash(_word, _length);
+            if (find(wordHash, _word, _length, _lemma, true)) {
+                m_hits.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+            uint32_t generation = m_snapshotGeneration.load(std::memory_order_relaxed);
+            if (wordSnapshot_t::lookup(generation, wordHash, _word, _length, _lemma)) {
+                insert(_word, _length, _lemma.c_str(), _lemma.length());
+                m_hits.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+            m_misses.fetch_add(1, std::memory_order_relaxed);
+            
+            return false;
+        }
+        
+        // the lemma the table holds for the word, for workers refreshing entries: neither counted as a hit
+        // or a miss nor looked up in the snapshot, nor keeps the entry from eviction
+        bool peek(const char *_word, std::size_t _length, std::string &_lemma) {
+            if (_length == 0 || _length >= dataMax) {
+                return false;
+            }
+            return find(hash(_word, _length), _word, _length, _lemma, false);
+        }
+        
+        void insert(const char *_word, std::size_t _wordLength, const char *_lemma, std::size_t _lemmaLength) {
+            if (_wordLength == 0 || _wordLength + _lemmaLength > dataMax) {
+                return;
+            }
+            
+            uint32_t wordHash = hash(_word, _wordLength);
+            set_t &set = sets()[wordHash % m_sets];
+            entry_t *setEntries = entries() + static_cast<std::size_t>(wordHash % m_sets) * ways;
+            bool locked = false;
+            while (!set.m_locked.compare_exchange_weak(locked, true, std::memory_order_acquire)) {
+                locked = false;
+            }
+            
+            entry_t *victim = nullptr;
+            for (uint32_t i = 0; i < ways; ++i) {
+                entry_t &entry = setEntries[i];
+                if (entry.m_hash == wordHash && entry.m_wordLength == _wordLength &&
+                    memcmp(entry.m_data, _word, _wordLength) == 0) {
+                    victim = &entry; // known word, refresh its lemma
+                    break;
+                }
+            }
+            while (victim == nullptr) {
+                entry_t &entry = setEntries[set.m_hand];
+                set.m_hand = static_cast<uint8_t>((set.m_hand + 1) % ways);
+                if (entry.m_wordLength == 0) {
+                    victim = &entry;
+                } else if (entry.m_referenced.load(std::memory_order_relaxed) != 0) {
+                    entry.m_referenced.store(0, std::memory_order_relaxed);
+                } else {
+                    victim = &entry;
+                    m_evictions.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+            
+            uint32_t version = victim->m_version.load(std::memory_order_relaxed);
+            victim->m_version.store(version + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            victim->m_hash = wordHash;
+            victim->m_wordLength = static_cast<uint8_t>(_wordLength);
+            victim->m_lemmaLength = static_cast<uint8_t>(_lemmaLength);
+            memcpy(victim->m_data, _word, _wordLength);
+            memcpy(victim->m_data + _wordLength, _lemma, _lemmaLength);
+            victim->m_referenced.store(0, std::memory_order_relaxed);
+            victim->m_version.store(version + 2, std::memory_order_release);
+            m_insertions.fetch_add(1, std::memory_order_relaxed);
+            
+            set.m_locked.store(false, std::memory_order_release);
+        }
+        
+        // copies out the consistent entries, for the snapshot
+        void collect(std::vector<wordSnapshot_t::pair_t> &_pairs) {
+            _pairs.clear();
+            char data[dataMax];
+            for (uint32_t i = 0; i < m_sets * ways; ++i) {
+                entry_t &entry = entries()[i];
+                uint32_t version = entry.m_version.load(std::memory_order_acquire);
+                if ((version & 1) != 0) {
+                    continue;
+                }
+                uint32_t wordHash = entry.m_hash;
+                std::size_t wordLength = entry.m_wordLength;
+                if (wordLength > dataMax) {
+                    wordLength = dataMax;
+                }
+                std::size_t lemmaLength = std::min(static_cast<std::size_t>(entry.m_lemmaLength), dataMax - wordLength);
+                memcpy(data, entry.m_data, wordLength + lemmaLength);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (wordLength > 0 && entry.m_version.load(std::memory_order_relaxed) == version) {
+                    _pairs.push_back(wordSnapshot_t::pair_t{wordHash, std::string(data, wordLength),
+                                                            std::string(data + wordLength, lemmaLength)});
+                }
+            }
+        }
+        
+        uint64_t insertions() const {
+            return m_insertions.load(std::memory_order_relaxed);
+        }
+        
+        // maps the current snapshot, so the words learned before a restart are served from the start
+        void mapSnapshot() {
+            if (wordSnapshotInterval > 0) {
+                wordSnapshot_t::attach(m_snapshotGeneration.load(std::memory_order_relaxed));
+            }
+        }
+        
+        // processes map the new snapshot on their next miss
+        void snapshotSaved() {
+            m_snapshotGeneration.fetch_add(1, std::memory_order_relaxed);
+        }
+        
+        cacheStats_t stats() const {
+            return cacheStats_t{m_hits.load(std::memory_order_relaxed), m_misses.load(std::memory_order_relaxed),
+                                m_insertions.load(std::memory_order_relaxed),
+                                m_evictions.load(std::memory_order_relaxed)};
+        }
+    };
+    
+    const char *wordCache_t::shmName = "pg_mystem word cache";
+    wordCache_t *wordCache_t::m_attached = nullptr;
+    
+    // MurmurHash3 x64 128-bit (A. Appleby, public domain) of a document
+    static inline uint64_t rotl64(uint64_t _x, int _r) {
+        return (_x << _r) | (_x >> (64 - _r));
+    }
+    
+    static inline uint64_t fmix64(uint64_t _k) {
+        _k ^= _k >> 33;
+        _k *= 0xff51afd7ed558ccdULL;
+        _k ^= _k >> 33;
+        _k *= 0xc4ceb9fe1a85ec53ULL;
+        _k ^= _k >> 33;
+        return _k;
+    }
+    
+    static void hash128(const char *_data, std::size_t _length, uint64_t (&_hash)[2]) {
+        const uint64_t c1 = 0x87c37b91114253d5ULL;
+        const uint64_t c2 = 0x4cf5ad432745937fULL;
+        const unsigned char *data = reinterpret_cast<const unsigned char *>(_data);
+        uint64_t h1 = 0, h2 = 0;
+        
+        std::size_t blocks = _length / 16;
+        for (std::size_t i = 0; i < blocks; ++i) {
+            uint64_t k1, k2;
+            memcpy(&k1, data + i * 16, sizeof(k1));
+            memcpy(&k2, data + i * 16 + 8, sizeof(k2));
+            k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+            h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+            k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+            h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+        }
+        
+        const unsigned char *tail = data + blocks * 16;
+        std::size_t rest = _length & 15;
+        uint64_t k1 = 0, k2 = 0;
+        for (std::size_t i = rest; i > 8; --i) {
+            k2 ^= static_cast<uint64_t>(tail[i - 1]) << ((i - 9) * 8);
+        }
+        if (rest > 8) {
+            k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        }
+        for (std::size_t i = std::min(rest, static_cast<std::size_t>(8)); i > 0; --i) {
+            k1 ^= static_cast<uint64_t>(tail[i - 1]) << ((i - 1) * 8);
+        }
+        if (rest > 0) {
+            k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        }
+        
+        h1 ^= _length; h2 ^= _length;
+        h1 += h2; h2 += h1;
+        h1 = fmix64(h1); h2 = fmix64(h2);
+        h1 += h2; h2 += h1;
+        _hash[0] = h1;
+        _hash[1] = h2;
+    }
+    
+    // Shared cache of whole mystem results keyed by the 128-bit hash and the length of the document.
+    // The cache is split into partitions by the hash, each partition has its own LWLock, a chained hash index,
+    // entries reclaimed with the CLOCK algorithm and a block arena for the results.
+    class resultCache_t {
+    public:
+        static const uint32_t partitionsNo = 16;
+        static const char *trancheName;
+        
+        // 128-bit hash and length of a document
+        struct key_t {
+            uint64_t m_hash[2];
+            uint32_t m_docLength;
+            
+            bool operator==(const key_t &_other) const {
+                return m_hash[0] == _other.m_hash[0] && m_hash[1] == _other.m_hash[1] &&
+                       m_docLength == _other.m_docLength;
+            }
+        };
+        
+    private:
+        static const uint32_t noEntry = 0xFFFFFFFF;
+        static const std::size_t entryBudget = 256; // shared memory per entry: the entry, its bucket and result blocks
+        typedef blockArena_t<64> arena_t;
+        
+        struct entry_t {
+            key_t m_key;
+            uint32_t m_next; // next entry of the bucket chain or of the free list
+            uint32_t m_payload;
+            uint32_t m_length;
+            std::atomic<uint8_t> m_referenced;
+            bool m_used;
+        };
+        
+        struct partition_t {
+            LWLock *m_lock;
+            uint32_t m_entries;
+            uint32_t m_freeEntries;
+            uint32_t m_hand;
+            
+            static std::size_t headerSize() {
+                return CACHELINEALIGN(sizeof(partition_t));
+            }
+            
+            static std::size_t arenaBytes(uint32_t _entries) {
+                return static_cast<std::size_t>(_entries) * (entryBudget - sizeof(entry_t) - sizeof(uint32_t));
+            }
+            
+            static std::size_t size(uint32_t _entries) {
+                return headerSize() + CACHELINEALIGN(sizeof(uint32_t) * _entries) +
+                       CACHELINEALIGN(sizeof(entry_t) * _entries) + CACHELINEALIGN(arena_t::size(arenaBytes(_entries)));
+            }
+            
+            uint32_t *buckets() {
+                return reinterpret_cast<uint32_t *>(reinterpret_cast<char *>(this) + headerSize());
+            }
+            
+            entry_t *entries() {
+                return reinterpret_cast<entry_t *>(reinterpret_cast<char *>(this) + headerSize() +
+                                                   CACHELINEALIGN(sizeof(uint32_t) * m_entries));
+            }
+            
+            arena_t *arena() {
+                return reinterpret_cast<arena_t *>(reinterpret_cast<char *>(this) + headerSize() +
+                                                   CACHELINEALIGN(sizeof(uint32_t) * m_entries) +
+                                                   CACHELINEALIGN(sizeof(entry_t) * m_entries));
+            }
+            
+            uint32_t &bucket(const key_t &_key) {
+                return buckets()[_key.m_hash[1] % m_entries];
+            }
+            
+            uint32_t find(const key_t &_key) {
+                for (uint32_t idx = bucket(_key); idx != noEntry; idx = entries()[idx].m_next) {
+                    if (entries()[idx].m_key == _key) {
+                        return idx;
+                    }
+                }
+                return noEntry;
+            }
+            
+            void remove(uint32_t _idx) {
+                entry_t &entry = entries()[_idx];
+                uint32_t *link = &bucket(entry.m_key);
+                while (*link != _idx) {
+                    link = &entries()[*link].m_next;
+                }
+                *link = entry.m_next;
+                arena()->release(entry.m_payload);
+                entry.m_used = false;
+                entry.m_next = m_freeEntries;
+                m_freeEntries = _idx;
+            }
+            
+            // frees one entry that was not used since the hand passed it last time
+            bool evict() {
+                for (uint32_t i = 0; i < 2 * m_entries; ++i) {
+                    uint32_t idx = m_hand;
+                    m_hand = (m_hand + 1) % m_entries;
+                    entry_t &entry = entries()[idx];
+                    if (!entry.m_used) {
+                        continue;
+                    }
+                    if (entry.m_referenced.load(std::memory_order_relaxed) != 0) {
+                        entry.m_referenced.store(0, std::memory_order_relaxed);
+                        continue;
+                    }
+                    remove(idx);
+                    return true;
+                }
+                return false;
+            }
+        };
+        
+        static const char *shmName;
+        static resultCache_t *m_attached;
+        
+        uint32_t m_partitionEntries;
+        std::atomic<uint64_t> m_hits;
+        std::atomic<uint64_t> m_misses;
+        std::atomic<uint64_t> m_insertions;
+        std::atomic<uint64_t> m_evictions;
+        
+        static std::size_t headerSize() {
+            return CACHELINEALIGN(sizeof(resultCache_t));
+        }
+        
+        static uint32_t entriesFor(std::size_t _bytes) {
+            return static_cast<uint32_t>(std::min(_bytes / partitionsNo / entryBudget,
+                                                  static_cast<std::size_t>(noEntry - 1)));
+        }
+        
+        partition_t *partition(const key_t &_key) {
+            return reinterpret_cast<partition_t *>(reinterpret_cast<char *>(this) + headerSize() +
+                                                   (_key.m_hash[0] % partitionsNo) * partition_t::size(m_partitionEntries));
+        }
+        
+    public:
+        static std::size_t size(std::size_t _bytes) {
+            uint32_t entries = entriesFor(_bytes);
+            if (entries == 0) {
+                return 0;
+            }
+            return headerSize() + partition_t::size(entries) * partitionsNo;
+        }
+        
+        // called by postmaster from the shmem_startup_hook, the tranche is requested in _PG_init
+        static void init(std::size_t _bytes) {
+            if (size(_bytes) == 0) {
+                return;
+            }
+            
+            bool found = false;
+            resultCache_t *cache = static_cast<resultCache_t *>(ShmemInitStruct(shmName, size(_bytes), &found));
+            if (found) {
+                return;
+            }
+            
+            uint32_t entries = entriesFor(_bytes);
+            cache->m_partitionEntries = entries;
+            new (&cache->m_hits) std::atomic<uint64_t>(0);
+            new (&cache->m_misses) std::atomic<uint64_t>(0);
+            new (&cache->m_insertions) std::atomic<uint64_t>(0);
+            new (&cache->m_evictions) std::atomic<uint64_t>(0);
+            LWLockPadded *locks = GetNamedLWLockTranche(trancheName);
+            for (uint32_t i = 0; i < partitionsNo; ++i) {
+                partition_t *part = reinterpret_cast<partition_t *>(reinterpret_cast<char *>(cache) + headerSize() +
+                                                                    i * partition_t::size(entries));
+                part->m_lock = &locks[i].lock;
+                part->m_entries = entries;
+                part->m_freeEntries = 0;
+                part->m_hand = 0;
+                for (uint32_t j = 0; j < entries; ++j) {
+                    part->buckets()[j] = noEntry;
+                    entry_t &entry = part->entries()[j];
+                    new (&entry.m_referenced) std::atomic<uint8_t>(0);
+                    entry.m_used = false;
+                    entry.m_next = (j + 1 < entries) ? j + 1 : noEntry;
+                }
+                part->arena()->init(partition_t::arenaBytes(entries));
+            }
+        }
+        
+        // returns the cache of the process or nullptr if the cache is disabled
+        static resultCache_t *attach(std::size_t _bytes) {
+            if (m_attached == nullptr && size(_bytes) > 0) {
+                bool found = false;
+                resultCache_t *cache = static_cast<resultCache_t *>(ShmemInitStruct(shmName, size(_bytes), &found));
+                if (found) {
+                    m_attached = cache;
+                }
+            }
+            
+            return m_attached;
+        }
+        
+        static key_t key(const std::string &_doc) {
+            key_t docKey;
+            hash128(_doc.data(), _doc.length(), docKey.m_hash);
+            docKey.m_docLength = static_cast<uint32_t>(_doc.length());
+            return docKey;
+        }
+        
+        bool lookup(const key_t &_key, std::string &_result) {
+            partition_t *part = partition(_key);
+            bool found = false;
+            LWLockAcquire(part->m_lock, LW_SHARED);
+            uint32_t idx = part->find(_key);
+            if (idx != noEntry) {
+                entry_t &entry = part->entries()[idx];
+                _result.clear();
+                part->arena()->read(entry.m_payload, entry.m_length, _result);
+                entry.m_referenced.store(1, std::memory_order_relaxed);
+                found = true;
+            }
+            LWLockRelease(part->m_lock);
+            (found ? m_hits : m_misses).fetch_add(1, std::memory_order_relaxed);
+            
+            return found;
+        }
+        
+        void insert(const key_t &_key, const std::string &_result) {
+            partition_t *part = partition(_key);
+            if (arena_t::blocksFor(_result.length()) > part->arena()->blocks()) {
+                return;
+            }
+            
+            LWLockAcquire(part->m_lock, LW_EXCLUSIVE);
+            if (part->find(_key) == noEntry) {
+                uint64_t evicted = 0;
+                bool fits = true;
+                if (part->m_freeEntries == noEntry) {
+                    fits = part->evict();
+                    evicted += fits ? 1 : 0;
+                }
+                uint32_t payload = arena_t::noBlock;
+                while (fits && !part->arena()->allocate(_result.length(), 0, payload)) {
+                    fits = part->evict();
+                    evicted += fits ? 1 : 0;
+                }
+                if (fits) {
+                    uint32_t idx = part->m_freeEntries;
+                    entry_t &entry = part->entries()[idx];
+                    part->m_freeEntries = entry.m_next;
+                    part->arena()->write(payload, 0, _result.data(), _result.length());
+                    entry.m_key = _key;
+                    entry.m_payload = payload;
+                    entry.m_length = static_cast<uint32_t>(_result.length());
+                    entry.m_referenced.store(0, std::memory_order_relaxed);
+                    entry.m_used = true;
+                    entry.m_next = part->bucket(_key);
+                    part->bucket(_key) = idx;
+                    m_insertions.fetch_add(1, std::memory_order_relaxed);
+                }
+                m_evictions.fetch_add(evicted, std::memory_order_relaxed);
+            }
+            LWLockRelease(part->m_lock);
+        }
+        
+        cacheStats_t stats() const {
+            return cacheStats_t{m_hits.load(std::memory_order_relaxed), m_misses.load(std::memory_order_relaxed),
+                                m_insertions.load(std::memory_order_relaxed),
+                                m_evictions.load(std::memory_order_relaxed)};
+        }
+    };
+    
+    const char *resultCache_t::trancheName = "pg_mystem result cache";
+    const char *resultCache_t::shmName = "pg_mystem result cache";
+    resultCache_t *resultCache_t::m_attached = nullptr;
+    
+    // Appends tokens of mystem output to the result: a word with its lemma or a text mystem has not analyzed;
+    // word forms and their lemmas are remembered in the word cache
+    class mystemTokenSink_t {
+    private:
+        std::string &m_normLine;
+        wordCache_t *m_wordCache;
+        requestKind_t m_kind;
+        
+        static bool marker(const char *_text, std::size_t _length) {
+            return _length == mystemParagraphEndMarker.length() &&
+                   memcmp(_text, mystemParagraphEndMarker.c_str(), _length) == 0;
+        }
+        
+    public:
+        mystemTokenSink_t(std::string &_normLine, wordCache_t *_wordCache, requestKind_t _kind):
+                m_normLine(_normLine), m_wordCache(_wordCache), m_kind(_kind) {}
+        
+        // a text without analysis is a word if it starts with a letter or a digit
+        // (ASCII, Latin-1 Supplement and Latin Extended or Cyrillic), otherwise it is a blank
+        static bool wordText(const char *_text, std::size_t _length) {
+            unsigned char first = static_cast<unsigned char>(_text[0]);
+            if (first < 0x80) {
+                return isalnum(first) != 0;
+            }
+            if (_length < 2) {
+                return false;
+            }
+            unsigned char second = static_cast<unsigned char>(_text[1]);
+            return (first == 0xC3 && second >= 0x80 && second != 0x97 && second != 0xB7) ||
+                   (first >= 0xC4 && first <= 0xC9) || (first >= 0xD0 && first <= 0xD3);
+        }
+        
+        void lemma(const char *_text, std::size_t _textLength, const char *_lex, std::size_t _lexLength) {
+            if (marker(_text, _textLength)) {
+                return;
+            }
+            if (m_kind == REQUEST_TOKENS) {
+                m_normLine += tokenLemma;
+                m_normLine.append(_lex, _lexLength);
+                m_normLine += '\n';
+            } else {
+                m_normLine.append(_lex, _lexLength);
+            }
+            if (m_wordCache != nullptr) {
+                std::string cached;
+                if (!m_wordCache->peek(_text, _textLength, cached) ||
+                    cached.compare(0, std::string::npos, _lex, _lexLength) != 0) {
+                    m_wordCache->insert(_text, _textLength, _lex, _lexLength);
+                }
+            }
+        }
+        
+        // the line break between two lines of a document, a blank like every other; the "\n" token that ends
+        // a JSON output line is dropped by text(), so both protocols pass line breaks here
+        void lineBreak() {
+            if (m_kind == REQUEST_TEXT) {
+                m_normLine += ' ';
+            }
+        }
+        
+        void text(const char *_text, std::size_t _textLength) {
+            if (_textLength == 0 || marker(_text, _textLength) || (_textLength == 1 && _text[0] == '\n')) {
+                return;
+            }
+            if (m_kind == REQUEST_TEXT) {
+                std::size_t pos = m_normLine.length();
+                m_normLine.append(_text, _textLength);
+                std::replace(m_normLine.begin() + pos, m_normLine.end(), '\n', ' ');
+            } else if (wordText(_text, _textLength)) {
+                m_normLine += tokenWord;
+                m_normLine.append(_text, _textLength);
+                std::replace(m_normLine.end() - _textLength, m_normLine.end(), '\n', ' ');
+                m_normLine += '\n';
+            }
+        }
+    };
+    
+    // SAX handler of one mystem JSON output line (pg_mystem.protocol = json), an array of token objects:
+    //   [{"analysis":[{"lex":"...","gr":"..."}],"text":"..."},{"text":" "},...]
+    // every token passes its last lemma, or its text if there is no lemma, to the sink
+    class mystemJsonHandler_t: public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, mystemJsonHandler_t> {
+    private:
+        enum key_t {
+            KEY_OTHER = 0,
+            KEY_ANALYSIS,
+            KEY_LEX,
+            KEY_TEXT
+        };
+        
+        mystemTokenSink_t m_sink;
+        unsigned int m_depth;
+        key_t m_key;
+        bool m_hasLex;
+        const char *m_lex;
+        rapidjson::SizeType m_lexLength;
+        const char *m_text;
+        rapidjson::SizeType m_textLength;
+        
+    public:
+        mystemJsonHandler_t(std::string &_normLine, wordCache_t *_wordCache, requestKind_t _kind):
+                m_sink(_normLine, _wordCache, _kind), m_depth(0), m_key(KEY_OTHER), m_hasLex(false), m_lex(nullptr),
+                m_lexLength(0), m_text(nullptr), m_textLength(0) {}
+        
+        bool StartArray() {
+            ++m_depth;
+            return true;
+        }
+        
+        bool EndArray(rapidjson::SizeType) {
+            --m_depth;
+            return true;
+        }
+        
+        bool StartObject() {
+            if (++m_depth == 2) {
+                m_lex = nullptr;
+                m_lexLength = 0;
+                m_text = nullptr;
+                m_textLength = 0;
+            } else if (m_depth == 4) {
+                m_hasLex = false;
+            }
+            return true;
+        }
+        
+        bool Key(const char *_str, rapidjson::SizeType _length, bool) {
+            m_key = KEY_OTHER;
+            if (m_depth == 2) {
+                if (_length == 8 && memcmp(_str, "analysis", 8) == 0) {
+                    m_key = KEY_ANALYSIS;
+                } else if (_length == 4 && memcmp(_str, "text", 4) == 0) {
+                    m_key = KEY_TEXT;
+                }
+            } else if (m_depth == 4 && _length == 3 && memcmp(_str, "lex", 3) == 0) {
+                m_key = KEY_LEX;
+                m_hasLex = true;
+            }
+            return true;
+        }
+        
+        bool String(const char *_str, rapidjson::SizeType _length, bool) {
+            if (m_depth == 2 && m_key == KEY_TEXT) {
+                m_text = _str;
+                m_textLength = _length;
+            } else if (m_depth == 4 && m_key == KEY_LEX) {
+                m_lex = _str;
+                m_lexLength = _length;
+            }
+            m_key = KEY_OTHER;
+            return true;
+        }
+        
+        bool EndObject(rapidjson::SizeType) {
+            if (m_depth == 4 && !m_hasLex) {
+                elog(LOG, "MYSTEM: JSON format error");
+            } else if (m_depth == 2) {
+                if (m_text == nullptr) {
+                    elog(LOG, "MYSTEM: JSON format error");
+                } else if (m_lexLength > 0) {
+                    m_sink.lemma(m_text, m_textLength, m_lex, m_lexLength);
+                } else {
+                    m_sink.text(m_text, m_textLength);
+                }
+            }
+            --m_depth;
+            return true;
+        }
+    };
+    
+    // Scanner of one line of mystem plain text output (pg_mystem.protocol = text, mystem -cd): the input copied
+    // with every word followed by its lemma in braces, "word{lemma}", and '?' after the lemma of a guessed or an
+    // unknown word. mystem analyses only words with Cyrillic letters, so a '{' opens a lemma only right after such
+    // a word, whose lemma mystem always puts there, and a lemma has no blanks or braces: braces of the document
+    // itself, as in "id{42}", stay in the text; the text between lemmas goes to the sink in word and blank runs.
+    class mystemTextScanner_t {
+    private:
+        mystemTokenSink_t m_sink;
+        
+        static std::size_t charLength(unsigned char _c) {
+            return (_c < 0xC0) ? 1 : (_c < 0xE0) ? 2 : (_c < 0xF0) ? 3 : 4;
+        }
+        
+        static bool wordChar(const char *_text, std::size_t _length) {
+            unsigned char c = static_cast<unsigned char>(_text[0]);
+            return mystemTokenSink_t::wordText(_text, std::min(_length, charLength(c)));
+        }
+        
+        void text(const char *_text, std::size_t _length) {
+            std::size_t pos = 0;
+            while (pos < _length) {
+                bool word = wordChar(_text + pos, _length - pos);
+                std::size_t end = pos;
+                while (end < _length && wordChar(_text + end, _length - end) == word) {
+                    end += charLength(static_cast<unsigned char>(_text[end]));
+                }
+                end = std::min(end, _length);
+                m_sink.text(_text + pos, end - pos);
+                pos = end;
+            }
+        }
+        
+    public:
+        mystemTextScanner_t(std::string &_normLine, wordCache_t *_wordCache, requestKind_t _kind):
+                m_sink(_normLine, _wordCache, _kind) {}
+        
+        void scan(const char *_line, std::size_t _length) {
+            std::size_t textPos = 0;
+            std::size_t wordPos = std::string::npos; // start of the word the scan is in
+            bool wordCyrillic = false; // the word has Cyrillic letters
+            std::size_t pos = 0;
+            while (pos < _length) {
+                char c = _line[pos];
+                if (c == '{' && wordCyrillic) {
+                    std::size_t lexEnd = pos + 1;
+                    while (lexEnd < _length && _line[lexEnd] != '}' && _line[lexEnd] != '{' && _line[lexEnd] != ' ') {
+                        ++lexEnd;
+                    }
+                    if (lexEnd < _length && _line[lexEnd] == '}') {
+                        // the last alternative without the guess marks
+                        const char *lex = _line + pos + 1;
+                        std::size_t lexLength = lexEnd - pos - 1;
+                        const char *bar = static_cast<const char *>(memrchr(lex, '|', lexLength));
+                        if (bar != nullptr) {
+                            lexLength -= bar + 1 - lex;
+                            lex = bar + 1;
+                        }
+                        while (lexLength > 0 && lex[lexLength - 1] == '?') {
+                            --lexLength;
+                        }
+                        
+                        text(_line + textPos, wordPos - textPos);
+                        if (lexLength > 0) {
+                            m_sink.lemma(_line + wordPos, pos - wordPos, lex, lexLength);
+                        } else {
+                            m_sink.text(_line + wordPos, pos - wordPos);
+                        }
+                        pos = lexEnd + 1;
+                        textPos = pos;
+                        wordPos = std::string::npos;
+                        wordCyrillic = false;
+                        continue;
+                    }
+                }
+                
+                // a hyphen inside a word belongs to it, mystem lemmatizes "кто-то" as a whole
+                bool word = wordChar(_line + pos, _length - pos) || (c == '-' && wordPos != std::string::npos);
+                if (!word) {
+                    wordPos = std::string::npos;
+                    wordCyrillic = false;
+                } else {
+                    if (wordPos == std::string::npos) {
+                        wordPos = pos;
+                    }
+                    unsigned char lead = static_cast<unsigned char>(c);
+                    wordCyrillic = wordCyrillic || (lead >= 0xD0 && lead <= 0xD3);
+                }
+                pos += charLength(static_cast<unsigned char>(c));
+            }
+            text(_line + textPos, std::min(pos, _length) - textPos);
+        }
+    };
+    
+    // Buffered reader of the mystem output. It reads the pipe with large reads and parses every complete
+    // line in place with the SAX reader or the text scanner, so neither lines nor tokens are copied.
+    // mystem answers every line of a document with a line, the line breaks between them go to the result
+    // as blanks, the way documents without Cyrillic words are converted.
+    class mystemReader_t {
+    private:
+        static const std::size_t bufferSize = 65536;
+        
+        std::vector<char> m_buffer;
+        std::size_t m_begin; // first unparsed byte
+        std::size_t m_end; // end of the read data
+        rapidjson::MemoryPoolAllocator<> m_allocator; // reused by every parse, so the reader stack is recycled
+        rapidjson::GenericReader<rapidjson::UTF8<>, rapidjson::UTF8<>, rapidjson::MemoryPoolAllocator<>> m_reader;
+        wordCache_t *m_wordCache;
+        mystemProtocol_t m_protocol;
+        
+    public:
+        explicit mystemReader_t(wordCache_t *_wordCache,
+                                mystemProtocol_t _protocol = static_cast<mystemProtocol_t>(mystemProtocol)):
+                m_buffer(bufferSize), m_begin(0), m_end(0), m_allocator(), m_reader(&m_allocator),
+                m_wordCache(_wordCache), m_protocol(_protocol) {}
+        
+        // reads available data, returns read() result
+        ssize_t fill(int _fd) {
+            if (m_begin > 0) {
+                memmove(m_buffer.data(), m_buffer.data() + m_begin, m_end - m_begin);
+                m_end -= m_begin;
+                m_begin = 0;
+            }
+            if (m_buffer.size() - m_end < bufferSize / 2) {
+                m_buffer.resize(m_buffer.size() * 2);
+            }
+            
+            ssize_t red = read(_fd, m_buffer.data() + m_end, m_buffer.size() - m_end - 1);
+            if (red > 0) {
+                m_end += red;
+            }
+            return red;
+        }
+        
+        // drops the buffered output of a mystem process that is gone
+        void reset() {
+            m_begin = 0;
+            m_end = 0;
+        }
+        
+        // parses buffered lines appending lemmas to _normLine,
+        // returns true when the document is complete, i.e. the marker line has been parsed
+        bool nextDocument(std::string &_normLine, requestKind_t _kind = REQUEST_TEXT) {
+            while (m_begin < m_end) {
+                char *line = m_buffer.data() + m_begin;
+                char *lineEnd = static_cast<char *>(memchr(line, '\n', m_end - m_begin));
+                if (lineEnd == nullptr) {
+                    return false;
+                }
+                *lineEnd = '\0';
+                m_begin = lineEnd - m_buffer.data() + 1;
+                
+                bool lastLine = (strstr(line, mystemParagraphEndMarker.c_str()) != nullptr);
+                if (lastLine) {
+                    MYSTEM_PROBE0(marker__received);
+                }
+                if (m_protocol == MYSTEM_PROTOCOL_TEXT) {
+                    mystemTextScanner_t scanner(_normLine, m_wordCache, _kind);
+                    scanner.scan(line, lineEnd - line);
+                } else {
+                    mystemJsonHandler_t handler(_normLine, m_wordCache, _kind);
+                    rapidjson::InsituStringStream stream(line);
+                    if (m_reader.Parse<rapidjson::kParseInsituFlag>(stream, handler).IsError()) {
+                        elog(LOG, "MYSTEM: JSON parsing failed");
+                    }
+                }
+                if (lastLine) {
+                    return true;
+                }
+                mystemTokenSink_t(_normLine, m_wordCache, _kind).lineBreak();
+            }
+            
+            return false;
+        }
+        
+        // reads mystem output up to the end of the next document,
+        // returns false if the pipe is closed or broken
+        bool readDocument(int _fd, std::string &_normLine) {
+            while (!nextDocument(_normLine)) {
+                if (fill(_fd) <= 0) {
+                    return false;
+                }
+            }
+            
+            return true;
+        }
+    };
+    
+    // queue attachment of the backend, created on the first call and kept until the backend exits
+    static inOutQueue_t *backendQueue = nullptr;
+    
+    static void detachBackendQueue(int, Datum) {
+        delete backendQueue;
+        backendQueue = nullptr;
+    }
+    
+    static inOutQueue_t *attachBackendQueue() {
+        if (backendQueue == nullptr) {
+            inOutQueue_t *queue = new inOutQueue_t;
+            if (!queue->isOK()) {
+                delete queue;
+                return nullptr;
+            }
+            backendQueue = queue;
+            before_shmem_exit(detachBackendQueue, 0);
+        }
+        
+        return backendQueue;
+    }
+    
+    // gives up on the documents in flight and reports the error to the caller
+    static void abandonDocuments(inOutQueue_t *_queue, const std::vector<std::pair<std::size_t, uint64_t>> &_inFlight,
+                                 const std::string &_error) {
+        for (auto &doc:_inFlight) {
+            _queue->abandonRecord(doc.second);
+        }
+        throw mystemError_t(_error);
+    }
+    
+    // true if CHECK_FOR_INTERRUPTS would raise an error now; the wait loop gives its documents up and unwinds
+    // first, since the error must not longjmp across C++ frames
+    static bool interruptRequested() {
+        return InterruptPending && InterruptHoldoffCount == 0 && CritSectionCount == 0 &&
+               (ProcDiePending || (QueryCancelPending && QueryCancelHoldoffCount == 0));
+    }
+    
+    // Cyrillic scanner: a byte from 0xD0 to 0xD3 is the lead byte of a Cyrillic letter (U+0400 - U+04FF)
+    // and never occurs elsewhere in UTF-8, so checking single bytes is enough; x86-64 builds use SSE2 or,
+    // when the CPU has it, AVX2, other platforms use the scalar loop; functions return _length if there
+    // are no Cyrillic letters
+    static inline bool cyrillicLead(unsigned char _byte) {
+        return (_byte & 0xFC) == 0xD0;
+    }
+    
+    static std::size_t findCyrillicScalar(const char *_data, std::size_t _length) {
+        for (std::size_t i = 0; i < _length; ++i) {
+            if (cyrillicLead(static_cast<unsigned char>(_data[i]))) {
+                return i;
+            }
+        }
+        return _length;
+    }
+    
+    static std::size_t lastCyrillicScalar(const char *_data, std::size_t _length) {
+        for (std::size_t i = _length; i > 0; --i) {
+            if (cyrillicLead(static_cast<unsigned char>(_data[i - 1]))) {
+                return i - 1;
+            }
+        }
+        return _length;
+    }
+    
+#ifdef MYSTEM_X86_SIMD
+    static inline uint32_t cyrillicMask16(const char *_data) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(_data));
+        __m128i leads = _mm_cmpeq_epi8(_mm_and_si128(bytes, _mm_set1_epi8(static_cast<char>(0xFC))),
+                                       _mm_set1_epi8(static_cast<char>(0xD0)));
+        return static_cast<uint32_t>(_mm_movemask_epi8(leads));
+    }
+    
+    __attribute__((target("avx2")))
+    static inline uint32_t cyrillicMask32(const char *_data) {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(_data));
+        __m256i leads = _mm256_cmpeq_epi8(_mm256_and_si256(bytes, _mm256_set1_epi8(static_cast<char>(0xFC))),
+                                          _mm256_set1_epi8(static_cast<char>(0xD0)));
+        return static_cast<uint32_t>(_mm256_movemask_epi8(leads));
+    }
+    
+    static std::size_t findCyrillicSSE2(const char *_data, std::size_t _length) {
+        std::size_t i = 0;
+        for (; i + 16 <= _length; i += 16) {
+            uint32_t mask = cyrillicMask16(_data + i);
+            if (mask != 0) {
+                return i + __builtin_ctz(mask);
+            }
+        }
+        std::size_t rest = findCyrillicScalar(_data + i, _length - i);
+        return (rest == _length - i) ? _length : i + rest;
+    }
+    
+    __attribute__((target("avx2")))
+    static std::size_t findCyrillicAVX2(const char *_data, std::size_t _length) {
+        std::size_t i = 0;
+        for (; i + 32 <= _length; i += 32) {
+            uint32_t mask = cyrillicMask32(_data + i);
+            if (mask != 0) {
+                return i + __builtin_ctz(mask);
+            }
+        }
+        std::size_t rest = findCyrillicScalar(_data + i, _length - i);
+        return (rest == _length - i) ? _length : i + rest;
+    }
+    
+    static std::size_t lastCyrillicSSE2(const char *_data, std::size_t _length) {
+        std::size_t i = _length;
+        for (; i >= 16; i -= 16) {
+            uint32_t mask = cyrillicMask16(_data + i - 16);
+            if (mask != 0) {
+                return i - 16 + 31 - __builtin_clz(mask);
+            }
+        }
+        std::size_t rest = lastCyrillicScalar(_data, i);
+        return (rest == i) ? _length : rest;
+    }
+    
+    __attribute__((target("avx2")))
+    static std::size_t lastCyrillicAVX2(const char *_data, std::size_t _length) {
+        std::size_t i = _length;
+        for (; i >= 32; i -= 32) {
+            uint32_t mask = cyrillicMask32(_data + i - 32);
+            if (mask != 0) {
+                return i - 32 + 31 - __builtin_clz(mask);
+            }
+        }
+        std::size_t rest = lastCyrillicScalar(_data, i);
+        return (rest == i) ? _length : rest;
+    }
+    
+    static bool hasAVX2() {
+        static const bool avx2 = __builtin_cpu_supports("avx2");
+        return avx2;
+    }
+#endif
+    
+    // offset of the first Cyrillic letter
+    static std::size_t findCyrillic(const char *_data, std::size_t _length) {
+#ifdef MYSTEM_X86_SIMD
+        return hasAVX2() ? findCyrillicAVX2(_data, _length) : findCyrillicSSE2(_data, _length);
+#else
+        return findCyrillicScalar(_data, _length);
+#endif
+    }
+    
+    // offset of the lead byte of the last Cyrillic letter
+    static std::size_t lastCyrillic(const char *_data, std::size_t _length) {
+#ifdef MYSTEM_X86_SIMD
+        return hasAVX2() ? lastCyrillicAVX2(_data, _length) : lastCyrillicSSE2(_data, _length);
+#else
+        return lastCyrillicScalar(_data, _length);
+#endif
+    }
+    
+    // text mystem has nothing to lemmatize in is copied unchanged, as mystem does, except for line breaks
+    // replaced with blanks
+    static void appendPassThrough(std::string &_result, const char *_data, std::size_t _length) {
+        std::size_t pos = _result.length();
+        _result.append(_data, _length);
+        for (std::size_t i = pos; i < _result.length(); ++i) {
+            if (_result[i] == '\n') {
+                _result[i] = ' ';
+            }
+        }
+    }
+    
+    // part of a document passed to mystem as a separate request or, if it has no Cyrillic letters,
+    // converted by the backend itself
+    struct docChunk_t {
+        std::size_t m_doc;
+        std::size_t m_pos;
+        std::size_t m_length;
+        const char *m_data; // m_length bytes from m_pos of the document
+        bool m_local;
+    };
+    
+    // Cyrillic-free text at least that long is not passed to mystem, shorter stretches go with their
+    // Cyrillic neighbours, so mystem sees them in context
+    static const std::size_t localSpanMin = 256;
+    
+    // end of the chunk starting at _pos of the span ending at _spanEnd: the last paragraph end, sentence end
+    // or blank in the second half of the allowed length, the last blank anywhere in it, or the last UTF-8
+    // character boundary; the boundary character stays in the chunk
+    static std::size_t chunkEnd(const std::string &_doc, std::size_t _pos, std::size_t _spanEnd,
+                                std::size_t _lengthMax) {
+        std::size_t end = _pos + _lengthMax;
+        if (end >= _spanEnd) {
+            return _spanEnd;
+        }
+        
+        std::size_t half = _pos + _lengthMax / 2;
+        std::size_t sentence = 0;
+        std::size_t blank = 0;
+        for (std::size_t i = end - 1; i > _pos; --i) {
+            char c = _doc[i];
+            if (c == '\n') {
+                if (i >= half) {
+                    return i + 1;
+                }
+                blank = std::max(blank, i + 1);
+                break;
+            }
+            if (c == ' ' || c == '\t') {
+                blank = std::max(blank, i + 1);
+                if (sentence == 0 && (_doc[i - 1] == '.' || _doc[i - 1] == '!' || _doc[i - 1] == '?')) {
+                    sentence = i + 1;
+                }
+            }
+            if (i < half && (sentence != 0 || blank != 0)) {
+                break;
+            }
+        }
+        if (sentence >= half) {
+            return sentence;
+        }
+        if (blank > _pos) {
+            return blank;
+        }
+        while (end > _pos + 1 && (static_cast<unsigned char>(_doc[end]) & 0xC0) == 0x80) {
+            --end;
+        }
+        
+        return end;
+    }
+    
+    static inline bool blankChar(char _c) {
+        return _c == ' ' || _c == '\t' || _c == '\n' || _c == '\r';
+    }
+    
+    // splits a document into chunks: Cyrillic-free stretches of at least localSpanMin bytes, cut at blanks,
+    // are converted locally, the Cyrillic-bearing spans between them go to mystem in chunks of at most
+    // _lengthMax bytes; token requests go to mystem as a whole
+    static void chunkDocument(std::size_t _docNo, const std::string &_doc, std::size_t _lengthMax, requestKind_t _kind,
+                              std::vector<docChunk_t> &_chunks) {
+        const char *data = _doc.c_str();
+        std::size_t length = _doc.length();
+        std::size_t pos = 0;
+        while (pos < length) {
+            std::size_t cyrillic = (_kind == REQUEST_TEXT) ? pos + findCyrillic(data + pos, length - pos) : pos;
+            if (cyrillic == length || cyrillic - pos >= localSpanMin) {
+                std::size_t cut = cyrillic;
+                while (cut < length && cut > pos && !blankChar(data[cut - 1])) {
+                    --cut;
+                }
+                if (cut > pos) {
+                    _chunks.push_back(docChunk_t{_docNo, pos, cut - pos, data + pos, true});
+                    pos = cut;
+                }
+                if (pos == length) {
+                    break;
+                }
+            }
+            
+            // the span ends at the first blank after the last Cyrillic letter followed by localSpanMin
+            // Cyrillic-free bytes, or at the end of the document
+            std::size_t spanEnd = length;
+            if (_kind == REQUEST_TEXT) {
+                std::size_t last = cyrillic;
+                while (true) {
+                    std::size_t from = last + 1;
+                    std::size_t window = std::min(localSpanMin, length - from);
+                    std::size_t found = lastCyrillic(data + from, window);
+                    if (found == window) {
+                        break;
+                    }
+                    last = from + found;
+                }
+                if (length - last > localSpanMin) {
+                    spanEnd = last + 1;
+                    while (spanEnd < length && !blankChar(data[spanEnd])) {
+                        ++spanEnd;
+                    }
+                    spanEnd = std::min(spanEnd + 1, length);
+                }
+            }
+            while (pos < spanEnd) {
+                std::size_t end = chunkEnd(_doc, pos, spanEnd, _lengthMax);
+                _chunks.push_back(docChunk_t{_docNo, pos, end - pos, data + pos, false});
+                pos = end;
+            }
+        }
+    }
+    
+    // lane of a document submitted by the session
+    static inline inOutQueue_t::lane_t documentLane(std::size_t _length) {
+        if (priority == PRIORITY_AUTO) {
+            return (_length <= interactiveLengthMax) ? inOutQueue_t::LANE_INTERACTIVE : inOutQueue_t::LANE_BULK;
+        }
+        return (priority == PRIORITY_INTERACTIVE) ? inOutQueue_t::LANE_INTERACTIVE : inOutQueue_t::LANE_BULK;
+    }
+    
+    // submits the chunks straight from their documents keeping as many of them in flight as the queue allows
+    // and waits for all the results, _fetch(chunk, ticket, failed) picks the result of a chunk up and returns
+    // false while it is not ready
+    template <typename fetch_t>
+    static void submitChunks(inOutQueue_t *_queue, const std::vector<docChunk_t> &_chunks, requestKind_t _kind,
+                             fetch_t _fetch) {
+        std::vector<std::pair<std::size_t, uint64_t>> inFlight;
+        std::size_t next = 0;
+        bool slotWaiter = false;
+        TimestampTz lastProgress = GetCurrentTimestamp();
+        while (next < _chunks.size() || !inFlight.empty()) {
+            if (interruptRequested()) {
+                abandonDocuments(_queue, inFlight, "request interrupted");
+            }
+            bool queueFull = false;
+            for (; next < _chunks.size(); ++next) {
+                if (_chunks[next].m_local) {
+                    continue;
+                }
+                uint64_t id = _queue->setInQueueRecord(_chunks[next].m_data, _chunks[next].m_length, _kind,
+                                                       documentLane(_chunks[next].m_length));
+                if (id == 0) {
+                    queueFull = true;
+                    break;
+                }
+                inFlight.push_back(std::make_pair(next, id));
+            }
+            
+            std::size_t pending = 0;
+            bool failed = false;
+            for (auto &doc:inFlight) {
+                bool docFailed = false;
+                if (!_fetch(doc.first, doc.second, docFailed)) {
+                    inFlight[pending++] = doc;
+                }
+                failed = failed || docFailed;
+            }
+            bool progress = (pending < inFlight.size());
+            inFlight.resize(pending);
+            if (failed) {
+                abandonDocuments(_queue, inFlight, "mystem failed to process a document");
+            }
+            if (progress || (next == _chunks.size() && inFlight.empty())) {
+                lastProgress = GetCurrentTimestamp();
+                continue;
+            }
+            
+            long timeout = queueFull ? freeSlotWaitTimeout : -1L;
+            if (requestTimeout > 0) {
+                long secs = 0;
+                int usecs = 0;
+                TimestampDifference(lastProgress, GetCurrentTimestamp(), &secs, &usecs);
+                long left = requestTimeout - (secs * 1000L + usecs / 1000);
+                if (left <= 0) {
+                    abandonDocuments(_queue, inFlight, "request timed out, see pg_mystem.request_timeout");
+                }
+                timeout = (timeout < 0) ? left : std::min(timeout, left);
+            }
+            
+            if (queueFull && !slotWaiter) {
+                // register as a waiter and recheck, a released slot sets our latch
+                _queue->waitForSlot();
+                slotWaiter = true;
+                continue;
+            }
+            slotWaiter = false;
+            
+            // workers set our latch when results are ready
+            _queue->reportWaitStart(queueFull ? inOutQueue_t::WAIT_QUEUE_SLOT : inOutQueue_t::WAIT_RESULT);
+            int rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_POSTMASTER_DEATH | (timeout >= 0 ? WL_TIMEOUT : 0), timeout);
+            _queue->reportWaitEnd();
+            ResetLatch(MyLatch);
+            if (rc & WL_POSTMASTER_DEATH) {
+                proc_exit(1);
+            }
+        }
+    }
+    
+    // results of the chunks converted locally, the rest are filled from the queue
+    static void localChunkResults(const std::vector<docChunk_t> &_chunks, std::vector<std::string> &_chunkResults) {
+        _chunkResults.assign(_chunks.size(), std::string());
+        for (std::size_t i = 0; i < _chunks.size(); ++i) {
+            if (_chunks[i].m_local) {
+                appendPassThrough(_chunkResults[i], _chunks[i].m_data, _chunks[i].m_length);
+                _chunkResults[i] += " \n";
+            }
+        }
+    }
+    
+    // joins the chunk results into the results of their documents; every text chunk result ends with the blank
+    // before the marker and the line break, both are dropped between the chunks
+    static void joinChunks(const std::vector<docChunk_t> &_chunks, std::vector<std::string> &_chunkResults,
+                           requestKind_t _kind, std::vector<std::string> &_results) {
+        mystemStats_t *stats = mystemStats_t::attach();
+        for (std::size_t i = 0; i < _chunks.size(); ++i) {
+            std::string &result = _results[_chunks[i].m_doc];
+            bool last = (i + 1 == _chunks.size() || _chunks[i + 1].m_doc != _chunks[i].m_doc);
+            if (_chunks[i].m_pos == 0) {
+                result.swap(_chunkResults[i]);
+                if (!last && stats != nullptr) {
+                    stats->countSplit();
+                }
+            } else {
+                result += _chunkResults[i];
+            }
+            if (!last && _kind == REQUEST_TEXT) {
+                if (!result.empty() && result.back() == '\n') {
+                    result.pop_back();
+                }
+                if (!result.empty() && result.back() == ' ') {
+                    result.pop_back();
+                }
+            }
+        }
+    }
+    
+    // converts documents with mystem, documents longer than the queue takes are split into chunks, so several
+    // workers convert them at once, and the chunk results are joined in the documents order; empty and already
+    // resolved documents are skipped
+    static void queueDocuments(inOutQueue_t *_queue, const std::vector<std::string> &_docs,
+                               std::vector<std::string> &_results, const std::vector<bool> &_resolved,
+                               requestKind_t _kind = REQUEST_TEXT) {
+        std::size_t lengthMax = _queue->documentLengthMax();
+        std::vector<docChunk_t> chunks;
+        for (std::size_t i = 0; i < _docs.size(); ++i) {
+            if (_docs[i].empty() || _resolved[i]) {
+                continue;
+            }
+            chunkDocument(i, _docs[i], lengthMax, _kind, chunks);
+        }
+        std::vector<std::string> chunkResults;
+        localChunkResults(chunks, chunkResults);
+        submitChunks(_queue, chunks, _kind, [&](std::size_t _chunk, uint64_t _id, bool &_failed) {
+            return _queue->getOutQueueRecord(_id, chunkResults[_chunk], _failed);
+        });
+        joinChunks(chunks, chunkResults, _kind, _results);
+    }
+    
+    // converts a document that goes to mystem as a single request without intermediate copies: the document
+    // is written to the arena straight from its varlena and the result is read back into a palloc'd text,
+    // a document without Cyrillic letters is converted in place; returns nullptr if the document needs
+    // the general path: the caches are on or it has to be split
+    static text *convertText(inOutQueue_t *_queue, const char *_doc, std::size_t _length) {
+        if (findCyrillic(_doc, _length) == _length) {
+            text *result = static_cast<text *>(palloc_extended(VARHDRSZ + _length + 2, MCXT_ALLOC_NO_OOM));
+            if (result == nullptr) {
+                throw mystemError_t("out of memory");
+            }
+            SET_VARSIZE(result, VARHDRSZ + _length + 2);
+            char *data = VARDATA(result);
+            for (std::size_t i = 0; i < _length; ++i) {
+                data[i] = (_doc[i] == '\n') ? ' ' : _doc[i];
+            }
+            memcpy(data + _length, " \n", 2);
+            return result;
+        }
+        if (wordCacheMode != WORD_CACHE_OFF || resultCache_t::attach(resultCacheSize * 1024L) != nullptr ||
+            _length > _queue->documentLengthMax()) {
+            return nullptr;
+        }
+        
+        text *result = nullptr;
+        submitChunks(_queue, std::vector<docChunk_t>(1, docChunk_t{0, 0, _length, _doc, false}), REQUEST_TEXT,
+                     [&](std::size_t, uint64_t _id, bool &_failed) {
+            return _queue->getOutQueueRecord(_id, result, _failed);
+        });
+        
+        return result;
+    }
+    
+    // part of a document, either a Cyrillic word or the text between words
+    struct docToken_t {
+        std::size_t m_pos;
+        std::size_t m_length;
+        bool m_word;
+    };
+    
+    // returns length of the UTF-8 Cyrillic letter at _pos or 0
+    static inline std::size_t cyrillicLetter(const std::string &_doc, std::size_t _pos) {
+        if (_pos + 1 < _doc.length()) {
+            unsigned char lead = static_cast<unsigned char>(_doc[_pos]);
+            unsigned char next = static_cast<unsigned char>(_doc[_pos + 1]);
+            if ((lead == 0xD0 && next >= 0x80 && next <= 0xBF) || (lead == 0xD1 && next >= 0x80 && next <= 0x9F)) {
+                return 2;
+            }
+        }
+        return 0;
+    }
+    
+    // splits a document into Cyrillic words (hyphenated compounds included) and the text between them,
+    // returns false if the document can not be converted without mystem: it has line breaks or words that mix
+    // Cyrillic with other letters or digits, mystem tokenizes those its own way
+    static bool splitDocument(const std::string &_doc, std::vector<docToken_t> &_tokens) {
+        _tokens.clear();
+        std::size_t textPos = 0;
+        std::size_t pos = 0;
+        while (pos < _doc.length()) {
+            char ch = _doc[pos];
+            if (ch == '\n' || ch == '\r') {
+                return false;
+            }
+            bool asciiAlnum = (isascii(ch) && isalnum(ch));
+            if (!asciiAlnum && cyrillicLetter(_doc, pos) == 0) {
+                ++pos;
+                continue;
+            }
+            
+            std::size_t wordPos = pos;
+            bool cyrillic = false;
+            bool other = false;
+            while (pos < _doc.length()) {
+                std::size_t letter = cyrillicLetter(_doc, pos);
+                if (letter > 0) {
+                    cyrillic = true;
+                    pos += letter;
+                } else if (isascii(_doc[pos]) && isalnum(_doc[pos])) {
+                    other = true;
+                    ++pos;
+                } else if (_doc[pos] == '-' && pos > wordPos && cyrillicLetter(_doc, pos + 1) > 0) {
+                    ++pos;
+                } else {
+                    break;
+                }
+            }
+            if (cyrillic && other) {
+                return false;
+            }
+            if (cyrillic) {
+                if (wordPos > textPos) {
+                    _tokens.push_back(docToken_t{textPos, wordPos - textPos, false});
+                }
+                _tokens.push_back(docToken_t{wordPos, pos - wordPos, true});
+                textPos = pos;
+            }
+        }
+        if (pos > textPos) {
+            _tokens.push_back(docToken_t{textPos, pos - textPos, false});
+        }
+        
+        return true;
+    }
+    
+    // converts unknown words with mystem, out of context, a few KB of space separated words per request;
+    // mystem returns one lemma per word, the words of a request stay unknown if the numbers do not match
+    static void learnWords(inOutQueue_t *_queue, const std::vector<std::string> &_words,
+                           std::unordered_map<std::string, std::string> &_lemmas) {
+        static const std::size_t requestLengthMax = 4096;
+        
+        std::vector<std::string> requests;
+        std::vector<std::size_t> firstWords;
+        for (std::size_t i = 0; i < _words.size(); ++i) {
+            if (requests.empty() || requests.back().length() + _words[i].length() >= requestLengthMax) {
+                requests.push_back(std::string());
+                firstWords.push_back(i);
+            } else {
+                requests.back() += ' ';
+            }
+            requests.back() += _words[i];
+        }
+        firstWords.push_back(_words.size());
+        
+        std::vector<std::string> results(requests.size());
+        queueDocuments(_queue, requests, results, std::vector<bool>(requests.size(), false));
+        
+        for (std::size_t i = 0; i < requests.size(); ++i) {
+            std::vector<std::string> lemmas;
+            std::size_t pos = 0;
+            while (true) {
+                pos = results[i].find_first_not_of(" \n", pos);
+                if (pos == std::string::npos) {
+                    break;
+                }
+                std::size_t end = results[i].find_first_of(" \n", pos);
+                lemmas.push_back(results[i].substr(pos, end - pos));
+                pos = end;
+            }
+            if (lemmas.size() == firstWords[i + 1] - firstWords[i]) {
+                for (std::size_t j = 0; j < lemmas.size(); ++j) {
+                    _lemmas[_words[firstWords[i] + j]] = lemmas[j];
+                }
+            }
+        }
+    }
+    
+    // converts documents with the word cache and marks them as resolved; in the tokens mode unknown words are
+    // converted by mystem first, the result looks exactly like mystem's one: words replaced with their lemmas and
+    // the space that separates a document from the end-of-article marker kept before the final line break
+    static void resolveDocuments(inOutQueue_t *_queue, wordCache_t *_wordCache, const std::vector<std::string> &_docs,
+                                 std::vector<std::string> &_results, std::vector<bool> &_resolved) {
+        std::vector<std::vector<docToken_t>> tokens(_docs.size());
+        std::vector<bool> splitted(_docs.size(), false);
+        std::unordered_map<std::string, std::string> lemmas; // empty lemma - unknown word
+        std::vector<std::string> unknownWords;
+        for (std::size_t i = 0; i < _docs.size(); ++i) {
+            if (_docs[i].empty() || !splitDocument(_docs[i], tokens[i])) {
+                continue;
+            }
+            splitted[i] = true;
+            for (auto &token:tokens[i]) {
+                if (!token.m_word) {
+                    continue;
+                }
+                std::string word(_docs[i], token.m_pos, token.m_length);
+                if (lemmas.find(word) != lemmas.end()) {
+                    continue;
+                }
+                std::string lemma;
+                if (!_wordCache->lookup(word.c_str(), word.length(), lemma)) {
+                    unknownWords.push_back(word);
+                }
+                lemmas.emplace(word, lemma);
+            }
+        }
+        
+        if (wordCacheMode == WORD_CACHE_TOKENS && !unknownWords.empty()) {
+            learnWords(_queue, unknownWords, lemmas);
+        }
+        
+        for (std::size_t i = 0; i < _docs.size(); ++i) {
+            if (!splitted[i]) {
+                continue;
+            }
+            std::string result;
+            result.reserve(_docs[i].length() + 2);
+            bool known = true;
+            for (auto &token:tokens[i]) {
+                if (token.m_word) {
+                    const std::string &lemma = lemmas[_docs[i].substr(token.m_pos, token.m_length)];
+                    if (lemma.empty()) {
+                        known = false;
+                        break;
+                    }
+                    result += lemma;
+                } else {
+                    appendPassThrough(result, _docs[i].c_str() + token.m_pos, token.m_length);
+                }
+            }
+            if (known) {
+                _results[i] = result + " \n";
+                _resolved[i] = true;
+            }
+        }
+    }
+    
+    // converts documents, results keep the documents order; documents converted by mystem
+    // are remembered in the result cache
+    static void convertDocuments(inOutQueue_t *_queue, const std::vector<std::string> &_docs,
+                                 std::vector<std::string> &_results) {
+        _results.assign(_docs.size(), std::string());
+        std::vector<bool> resolved(_docs.size(), false);
+        
+        resultCache_t *resultCache = resultCache_t::attach(resultCacheSize * 1024L);
+        std::vector<resultCache_t::key_t> keys;
+        if (resultCache != nullptr) {
+            keys.resize(_docs.size());
+            for (std::size_t i = 0; i < _docs.size(); ++i) {
+                if (!_docs[i].empty()) {
+                    keys[i] = resultCache_t::key(_docs[i]);
+                    resolved[i] = resultCache->lookup(keys[i], _results[i]);
+                }
+            }
+        }
+        
+        if (wordCacheMode != WORD_CACHE_OFF) {
+            wordCache_t *wordCache = wordCache_t::attach(wordCacheSize * 1024L);
+            if (wordCache != nullptr) {
+                resolveDocuments(_queue, wordCache, _docs, _results, resolved);
+            }
+        }
+        
+        std::vector<bool> queued(_docs.size());
+        for (std::size_t i = 0; i < _docs.size(); ++i) {
+            queued[i] = !resolved[i] && !_docs[i].empty();
+        }
+        queueDocuments(_queue, _docs, _results, resolved);
+        
+        if (resultCache != nullptr) {
+            for (std::size_t i = 0; i < _docs.size(); ++i) {
+                // an empty result means mystem failed on the document
+                if (queued[i] && !_results[i].empty()) {
+                    resultCache->insert(keys[i], _results[i]);
+                }
+            }
+        }
+    }
+    
+    // converts text[] array elements, returns palloc'd result datums and fills _nulls/_count,
+    // returns nullptr if the queue is not available or with palloc'd _error if mystem failed
+    static Datum *convertTextArray(ArrayType *_array, bool **_nulls, int *_count, char **_error) {
+        Datum *elems = nullptr;
+        deconstruct_array(_array, TEXTOID, -1, false, 'i', &elems, _nulls, _count);
+        
+        std::vector<std::string> results;
+        try {
+            std::vector<std::string> docs(*_count);
+            for (int i = 0; i < *_count; ++i) {
+                if (!(*_nulls)[i]) {
+                    text *doc = DatumGetTextPP(elems[i]);
+                    docs[i].assign(VARDATA_ANY(doc), VARSIZE_ANY_EXHDR(doc));
+                }
+            }
+            
+            inOutQueue_t *inOutQueue = attachBackendQueue();
+            if (inOutQueue == nullptr) {
+                return nullptr;
+            }
+            convertDocuments(inOutQueue, docs, results);
+        } catch (const mystemError_t &_e) {
+            *_error = pstrdup(_e.what());
+            return nullptr;
+        } catch (const std::exception &_e) {
+            elog(LOG, "MYSTEM: mystem_convert critical error: %s", _e.what());
+        } catch (...) {
+            elog(LOG, "MYSTEM: mystem_convert unknown critical error");
+        }
+        results.resize(*_count);
+        
+        for (int i = 0; i < *_count; ++i) {
+            if (!(*_nulls)[i]) {
+                elems[i] = PointerGetDatum(cstring_to_text_with_len(results[i].c_str(), results[i].length()));
+            }
+        }
+        
+        return elems;
+    }
+    
+    // converts a document to the token list, returns it palloc'd, returns nullptr with palloc'd _error
+    // if the queue is not available or mystem failed
+    static char *convertToTokens(const char *_doc, int _length, int *_tokensLength, char **_error) {
+        std::string tokens;
+        try {
+            inOutQueue_t *inOutQueue = attachBackendQueue();
+            if (inOutQueue == nullptr) {
+                *_error = pstrdup("mystem workers are not available");
+                return nullptr;
+            }
+            std::vector<std::string> results;
+            queueDocuments(inOutQueue, std::vector<std::string>(1, std::string(_doc, _length)), results,
+                           std::vector<bool>(1, false), REQUEST_TOKENS);
+            tokens.swap(results[0]);
+        } catch (const mystemError_t &_e) {
+            *_error = pstrdup(_e.what());
+            return nullptr;
+        } catch (const std::exception &_e) {
+            elog(LOG, "MYSTEM: mystem parser critical error: %s", _e.what());
+        } catch (...) {
+            elog(LOG, "MYSTEM: mystem parser unknown critical error");
+        }
+        
+        *_tokensLength = tokens.length();
+        return pnstrdup(tokens.c_str(), tokens.length());
+    }
+    
+    // Documents submitted by mystem_submit and mystem_convert_stream and not fetched yet. A session may submit
+    // more documents than the queue takes: their chunks go to the queue in the submission order as slots get
+    // free, and ready results of every request are picked up whichever request is fetched, so they do not hold
+    // the slots. Requests of streams are dropped with their streams at the end of the transaction, the rest
+    // live until they are fetched or cancelled.
+    class asyncRequests_t {
+    private:
+        struct request_t {
+            std::string m_doc;
+            std::vector<docChunk_t> m_chunks;
+            std::vector<uint64_t> m_tickets; // of the chunks in the queue, 0 - not submitted yet or fetched
+            std::vector<std::string> m_results;
+            std::size_t m_next; // first chunk not submitted yet
+            std::size_t m_inFlight;
+            bool m_failed;
+            bool m_cached; // m_results[0] is taken from the result cache
+            int64_t m_stream; // 0 - submitted by mystem_submit
+            resultCache_t::key_t m_key;
+            
+            bool done() const {
+                return m_next == m_chunks.size() && m_inFlight == 0;
+            }
+        };
+        
+        // rows of mystem_convert_stream: documents read from the cursor are submitted while fewer than
+        // m_window of them are in flight, the results are returned as they complete
+        struct stream_t {
+            int m_window;
+            int64_t m_rows;
+            std::map<int64_t, int64_t> m_ords; // request -> row number
+            std::deque<int64_t> m_nullRows;
+        };
+        
+        std::map<int64_t, std::unique_ptr<request_t>> m_requests;
+        std::map<int64_t, stream_t> m_streams;
+        int64_t m_lastId;
+        TimestampTz m_lastProgress;
+        bool m_queueFull;
+        bool m_slotWaiter;
+        
+        asyncRequests_t(): m_lastId(0), m_lastProgress(0), m_queueFull(false), m_slotWaiter(false) {
+            RegisterXactCallback(endTransaction, nullptr);
+        }
+        
+        static void endTransaction(XactEvent _event, void *) {
+            if (_event == XACT_EVENT_COMMIT || _event == XACT_EVENT_ABORT) {
+                session().dropStreams();
+            }
+        }
+        
+        void drop(request_t &_request) {
+            for (auto &ticket:_request.m_tickets) {
+                if (ticket != 0) {
+                    backendQueue->abandonRecord(ticket);
+                    ticket = 0;
+                }
+            }
+            _request.m_next = _request.m_chunks.size();
+            _request.m_inFlight = 0;
+        }
+        
+        void dropStreams() {
+            for (auto it = m_requests.begin(); it != m_requests.end();) {
+                if (it->second->m_stream != 0) {
+                    drop(*it->second);
+                    it = m_requests.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            m_streams.clear();
+        }
+        
+        // picks ready results up and submits waiting chunks, returns true if anything has moved
+        bool advance(inOutQueue_t *_queue) {
+            bool progress = false;
+            m_queueFull = false;
+            for (auto &entry:m_requests) {
+                request_t &request = *entry.second;
+                for (std::size_t i = 0; i < request.m_next && request.m_inFlight > 0; ++i) {
+                    bool failed = false;
+                    if (request.m_tickets[i] != 0 &&
+                        _queue->getOutQueueRecord(request.m_tickets[i], request.m_results[i], failed)) {
+                        request.m_tickets[i] = 0;
+                        --request.m_inFlight;
+                        progress = true;
+                        if (failed) {
+                            request.m_failed = true;
+                            drop(request);
+                        }
+                    }
+                }
+                for (; !m_queueFull && request.m_next < request.m_chunks.size(); ++request.m_next) {
+                    const docChunk_t &chunk = request.m_chunks[request.m_next];
+                    if (chunk.m_local) {
+                        continue;
+                    }
+                    uint64_t id = _queue->setInQueueRecord(chunk.m_data, chunk.m_length, REQUEST_TEXT,
+                                                           documentLane(chunk.m_length));
+                    if (id == 0) {
+                        m_queueFull = true;
+                        break;
+                    }
+                    request.m_tickets[request.m_next] = id;
+                    ++request.m_inFlight;
+                    progress = true;
+                }
+            }
+            if (progress) {
+                m_lastProgress = GetCurrentTimestamp();
+            }
+            
+            return progress;
+        }
+        
+    public:
+        static asyncRequests_t &session() {
+            static asyncRequests_t requests;
+            return requests;
+        }
+        
+        int64_t submit(inOutQueue_t *_queue, const char *_doc, std::size_t _length, int64_t _stream = 0) {
+            std::unique_ptr<request_t> request(new request_t());
+            request->m_doc.assign(_doc, _length);
+            request->m_next = 0;
+            request->m_inFlight = 0;
+            request->m_failed = false;
+            request->m_cached = false;
+            request->m_stream = _stream;
+            
+            resultCache_t *resultCache = resultCache_t::attach(resultCacheSize * 1024L);
+            if (resultCache != nullptr && _length > 0) {
+                request->m_key = resultCache_t::key(request->m_doc);
+                request->m_results.resize(1);
+                request->m_cached = resultCache->lookup(request->m_key, request->m_results[0]);
+            }
+            if (!request->m_cached) {
+                chunkDocument(0, request->m_doc, _queue->documentLengthMax(), REQUEST_TEXT, request->m_chunks);
+                localChunkResults(request->m_chunks, request->m_results);
+                request->m_tickets.assign(request->m_chunks.size(), 0);
+            }
+            
+            int64_t id = ++m_lastId;
+            m_requests[id] = std::move(request);
+            advance(_queue);
+            
+            return id;
+        }
+        
+        // returns true and the result once the request is done, throws if it is unknown or mystem failed on it;
+        // _advance is off when the caller has just advanced the queue
+        bool poll(inOutQueue_t *_queue, int64_t _id, std::string &_result, bool _advance = true) {
+            auto it = m_requests.find(_id);
+            if (it == m_requests.end()) {
+                throw mystemError_t("unknown request " + std::to_string(_id));
+            }
+            request_t &request = *it->second;
+            if (!request.done()) {
+                if (_advance) {
+                    advance(_queue);
+                }
+                if (!request.done()) {
+                    return false;
+                }
+            }
+            
+            if (request.m_failed) {
+                m_requests.erase(it);
+                throw mystemError_t("mystem failed to process a document");
+            }
+            if (request.m_cached) {
+                _result.swap(request.m_results[0]);
+            } else {
+                std::vector<std::string> results(1);
+                joinChunks(request.m_chunks, request.m_results, REQUEST_TEXT, results);
+                _result.swap(results[0]);
+                resultCache_t *resultCache = resultCache_t::attach(resultCacheSize * 1024L);
+                if (resultCache != nullptr && !request.m_doc.empty()) {
+                    resultCache->insert(request.m_key, _result);
+                }
+            }
+            m_requests.erase(it);
+            
+            return true;
+        }
+        
+        // waits for a result or a free slot, throws on a cancel or when nothing has moved for
+        // pg_mystem.request_timeout since _started
+        void wait(inOutQueue_t *_queue, TimestampTz _started) {
+            if (interruptRequested()) {
+                throw mystemError_t("request interrupted");
+            }
+            long timeout = m_queueFull ? freeSlotWaitTimeout : -1L;
+            if (requestTimeout > 0) {
+                long secs = 0;
+                int usecs = 0;
+                TimestampDifference(std::max(_started, m_lastProgress), GetCurrentTimestamp(), &secs, &usecs);
+                long left = requestTimeout - (secs * 1000L + usecs / 1000);
+                if (left <= 0) {
+                    throw mystemError_t("request timed out, see pg_mystem.request_timeout");
+                }
+                timeout = (timeout < 0) ? left : std::min(timeout, left);
+            }
+            
+            if (m_queueFull && !m_slotWaiter) {
+                // register as a waiter and recheck, a released slot sets our latch
+                _queue->waitForSlot();
+                m_slotWaiter = true;
+                return;
+            }
+            m_slotWaiter = false;
+            
+            _queue->reportWaitStart(m_queueFull ? inOutQueue_t::WAIT_QUEUE_SLOT : inOutQueue_t::WAIT_RESULT);
+            int rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_POSTMASTER_DEATH | (timeout >= 0 ? WL_TIMEOUT : 0), timeout);
+            _queue->reportWaitEnd();
+            ResetLatch(MyLatch);
+            if (rc & WL_POSTMASTER_DEATH) {
+                proc_exit(1);
+            }
+        }
+        
+        bool cancel(int64_t _id) {
+            auto it = m_requests.find(_id);
+            if (it == m_requests.end()) {
+                return false;
+            }
+            drop(*it->second);
+            m_requests.erase(it);
+            
+            return true;
+        }
+        
+        int64_t openStream(int _window) {
+            int64_t id = ++m_lastId;
+            m_streams[id] = stream_t{_window, 0, std::map<int64_t, int64_t>(), std::deque<int64_t>()};
+            return id;
+        }
+        
+        void closeStream(int64_t _stream) {
+            auto it = m_streams.find(_stream);
+            if (it == m_streams.end()) {
+                return;
+            }
+            for (auto &request:it->second.m_ords) {
+                cancel(request.first);
+            }
+            m_streams.erase(it);
+        }
+        
+        // documents the stream may read from its cursor now
+        long streamWanted(int64_t _stream) {
+            stream_t &stream = m_streams.at(_stream);
+            return std::max(static_cast<long>(stream.m_window) - static_cast<long>(stream.m_ords.size()), 0L);
+        }
+        
+        void streamAdd(inOutQueue_t *_queue, int64_t _stream, const char *_doc, std::size_t _length, bool _null) {
+            stream_t &stream = m_streams.at(_stream);
+            int64_t ord = ++stream.m_rows;
+            if (_null) {
+                stream.m_nullRows.push_back(ord);
+            } else {
+                stream.m_ords[submit(_queue, _doc, _length, _stream)] = ord;
+            }
+        }
+        
+        // 1 and the row number and the result of a completed document, 0 if none has completed yet,
+        // -1 if the stream has no documents in flight
+        int streamNext(inOutQueue_t *_queue, int64_t _stream, int64_t &_ord, bool &_null, std::string &_result) {
+            stream_t &stream = m_streams.at(_stream);
+            if (!stream.m_nullRows.empty()) {
+                _ord = stream.m_nullRows.front();
+                _null = true;
+                stream.m_nullRows.pop_front();
+                return 1;
+            }
+            advance(_queue);
+            for (auto it = stream.m_ords.begin(); it != stream.m_ords.end(); ++it) {
+                if (poll(_queue, it->first, _result, false)) {
+                    _ord = it->second;
+                    _null = false;
+                    stream.m_ords.erase(it);
+                    return 1;
+                }
+            }
+            
+            return stream.m_ords.empty() ? -1 : 0;
+        }
+    };
+    
+    static text *resultText(const std::string &_result) {
+        text *result = static_cast<text *>(palloc_extended(VARHDRSZ + _result.length(), MCXT_ALLOC_NO_OOM));
+        if (result == nullptr) {
+            throw mystemError_t("out of memory");
+        }
+        SET_VARSIZE(result, VARHDRSZ + _result.length());
+        memcpy(VARDATA(result), _result.data(), _result.length());
+        return result;
+    }
+    
+    // mystem_submit, mystem_fetch and mystem_convert_stream helpers, errors are returned palloc'd in _error
+    static int64_t submitDocument(const char *_doc, std::size_t _length, char **_error) {
+        try {
+            inOutQueue_t *inOutQueue = attachBackendQueue();
+            if (inOutQueue == nullptr) {
+                *_error = pstrdup("mystem workers are not available");
+                return 0;
+            }
+            return asyncRequests_t::session().submit(inOutQueue, _doc, _length);
+        } catch (const mystemError_t &_e) {
+            *_error = pstrdup(_e.what());
+        } catch (const std::exception &_e) {
+            *_error = pstrdup(_e.what());
+        }
+        
+        return 0;
+    }
+    
+    // returns nullptr if _wait is not set and the document is not converted yet
+    static text *fetchDocument(int64_t _id, bool _wait, char **_error) {
+        try {
+            inOutQueue_t *inOutQueue = attachBackendQueue();
+            if (inOutQueue == nullptr) {
+                *_error = pstrdup("mystem workers are not available");
+                return nullptr;
+            }
+            asyncRequests_t &requests = asyncRequests_t::session();
+            TimestampTz started = GetCurrentTimestamp();
+            std::string result;
+            while (!requests.poll(inOutQueue, _id, result)) {
+                if (!_wait) {
+                    return nullptr;
+                }
+                try {
+                    requests.wait(inOutQueue, started);
+                } catch (const mystemError_t &) {
+                    requests.cancel(_id);
+                    throw;
+                }
+            }
+            return resultText(result);
+        } catch (const mystemError_t &_e) {
+            *_error = pstrdup(_e.what());
+        } catch (const std::exception &_e) {
+            *_error = pstrdup(_e.what());
+        }
+        
+        return nullptr;
+    }
+    
+    static bool cancelDocument(int64_t _id) {
+        return backendQueue != nullptr && asyncRequests_t::session().cancel(_id);
+    }
+    
+    static int64_t openStream(int _window, char **_error) {
+        try {
+            if (attachBackendQueue() == nullptr) {
+                *_error = pstrdup("mystem workers are not available");
+                return 0;
+            }
+            return asyncRequests_t::session().openStream(_window);
+        } catch (const std::exception &_e) {
+            *_error = pstrdup(_e.what());
+        }
+        
+        return 0;
+    }
+    
+    static void closeStream(int64_t _stream) {
+        if (backendQueue != nullptr) {
+            asyncRequests_t::session().closeStream(_stream);
+        }
+    }
+    
+    static long streamWanted(int64_t _stream) {
+        return asyncRequests_t::session().streamWanted(_stream);
+    }
+    
+    static void streamAdd(int64_t _stream, const char *_doc, std::size_t _length, bool _null, char **_error) {
+        try {
+            asyncRequests_t::session().streamAdd(backendQueue, _stream, _doc, _length, _null);
+        } catch (const mystemError_t &_e) {
+            *_error = pstrdup(_e.what());
+        } catch (const std::exception &_e) {
+            *_error = pstrdup(_e.what());
+        }
+    }
+    
+    // returns streamNext() result, _result is palloc'd or nullptr for a NULL document
+    static int streamNext(int64_t _stream, int64_t *_ord, text **_result, char **_error) {
+        try {
+            std::string result;
+            bool isNull = false;
+            int next = asyncRequests_t::session().streamNext(backendQueue, _stream, *_ord, isNull, result);
+            if (next > 0) {
+                *_result = isNull ? nullptr : resultText(result);
+            }
+            return next;
+        } catch (const mystemError_t &_e) {
+            *_error = pstrdup(_e.what());
+        } catch (const std::exception &_e) {
+            *_error = pstrdup(_e.what());
+        }
+        
+        return -1;
+    }
+    
+    static void streamWait(TimestampTz _started, char **_error) {
+        try {
+            asyncRequests_t::session().wait(backendQueue, _started);
+        } catch (const mystemError_t &_e) {
+            *_error = pstrdup(_e.what());
+        } catch (const std::exception &_e) {
+            *_error = pstrdup(_e.what());
+        }
+    }
+}
+
+extern "C" {
+    static volatile sig_atomic_t mystemTerminated = false;
+    static volatile sig_atomic_t mystemReloadConfig = false;
+    
+    static void mystemSigterm(SIGNAL_ARGS) {
+        int save_errno = errno;
+        mystemTerminated = true;
+        SetLatch(MyLatch);
+        errno = save_errno;
+    }
+    
+    static void mystemSighup(SIGNAL_ARGS) {
+        int save_errno = errno;
+        mystemReloadConfig = true;
+        SetLatch(MyLatch);
+        errno = save_errno;
+    }
+    
+    #ifndef SHARE_FOLDER
         #error "SHARE_FOLDER must be defined"
     #else
         #define xstr(s) str(s)
@@ -339,221 +3624,840 @@ extern "C" {
         #define SHARE_FOLDER_STR xstr(SHARE_FOLDER)
     #endif
 
-    void createMystemChilds(Datum _arg) {
+    // forks mystem connected to a pair of non-blocking pipes, returns its pid or -1
+    static pid_t spawnMystem(int &_toMystem, int &_fromMystem) {
         int stdinPipe[2];
         int stdoutPipe[2];
         
-        if ((pipe(stdinPipe) < 0) || (pipe(stdoutPipe) < 0)) {
-            elog(ERROR, "MYSTEM: pipe call failed, errno = %d", errno);
-            proc_exit(1);
+        if (pipe(stdinPipe) < 0) {
+            elog(LOG, "MYSTEM: pipe call failed, errno = %d", errno);
+            return -1;
+        }
+        if (pipe(stdoutPipe) < 0) {
+            elog(LOG, "MYSTEM: pipe call failed, errno = %d", errno);
+            close(stdinPipe[0]);
+            close(stdinPipe[1]);
+            return -1;
+        }
+        
+        pid_t derivedPid = fork();
+        switch (derivedPid) {
+            case 0: {
+                // child continues here
+                close(STDOUT_FILENO);
+                close(STDIN_FILENO);
+                // redirect stdin, stdout, stderr
+                if ((dup2(stdoutPipe[0], STDIN_FILENO) == -1) || (dup2(stdinPipe[1], STDOUT_FILENO) == -1)) {
+                    elog(LOG, "MYSTEM: IO redirection failed, errno = %d", errno);
+                    _exit(1);
+                }
+                close(stdoutPipe[0]);
+                close(stdoutPipe[1]);
+                close(stdinPipe[0]);
+                close(stdinPipe[1]);
+                
+                // run child process image
+                std::string path = std::string(SHARE_FOLDER_STR) + "/mystem";
+                if (pg_ms::mystemProtocol == pg_ms::MYSTEM_PROTOCOL_TEXT) {
+                    execle(path.c_str(), path.c_str(), "-cd", NULL, NULL);
+                } else {
+                    execle(path.c_str(), path.c_str(), "-cd", "--format", "json", NULL, NULL);
+                }
+                
+                // if we get here at all, an error occurred, but we are in the child
+                // process, so just exit
+                elog(LOG, "MYSTEM: exec of the child process failed (%s), errno = %d", path.c_str(), errno);
+                _exit(1);
+            } case -1: {
+                // failed to create child
+                close(stdoutPipe[0]);
+                close(stdoutPipe[1]);
+                close(stdinPipe[0]);
+                close(stdinPipe[1]);
+                elog(LOG, "MYSTEM: failed to create child, errno=%d", errno);
+                return -1;
+            } default: {
+                // parent continues here
+                close(stdoutPipe[0]);
+                close(stdinPipe[1]);
+                _toMystem = stdoutPipe[1];
+                _fromMystem = stdinPipe[0];
+                
+                // both pipe ends are non-blocking, writing documents and reading results overlap
+                if (fcntl(_toMystem, F_SETFL, fcntl(_toMystem, F_GETFL) | O_NONBLOCK) == -1 ||
+                    fcntl(_fromMystem, F_SETFL, fcntl(_fromMystem, F_GETFL) | O_NONBLOCK) == -1) {
+                    elog(LOG, "MYSTEM: failed to set non-blocking mode, errno = %d", errno);
+                }
+                return derivedPid;
+            }
+        }
+    }
+    
+    // closes the pipes and reaps mystem, killing it if it is still running
+    static void stopMystem(pid_t _pid, int _toMystem, int _fromMystem) {
+        close(_toMystem);
+        close(_fromMystem);
+        
+        int status = 0;
+        pid_t reaped = waitpid(_pid, &status, WNOHANG);
+        if (reaped == 0) {
+            kill(_pid, SIGKILL);
+            waitpid(_pid, &status, 0);
+        } else if (reaped == _pid && WIFSIGNALED(status)) {
+            elog(LOG, "MYSTEM: mystem process %d was terminated by signal %d", _pid, WTERMSIG(status));
+        } else if (reaped == _pid && WIFEXITED(status)) {
+            elog(LOG, "MYSTEM: mystem process %d exited with code %d", _pid, WEXITSTATUS(status));
+        }
+    }
+    
+    // document taken from the queue and passed to mystem
+    struct inFlightDoc_t {
+        uint64_t m_id;
+        std::string m_doc;
+        pg_ms::requestKind_t m_kind;
+        TimestampTz m_taken;
+        TimestampTz m_written; // 0 - not written to mystem yet
+    };
+    
+    // mystem process of a worker place: its pipes, the documents passed to it and the restart backoff
+    struct mystemChild_t {
+        uint8_t m_workerNo;
+        bool m_active; // the place is in use
+        pid_t m_pid; // 0 - mystem is not running
+        int m_toMystem;
+        int m_fromMystem;
+        pg_ms::mystemReader_t m_reader;
+        std::string m_writeLine; // documents not written to mystem yet
+        std::size_t m_writePos;
+        std::deque<inFlightDoc_t> m_inFlight;
+        std::string m_result; // result of the first document in flight the arena had no room for
+        bool m_resultPending;
+        uint64_t m_served; // documents processed by the running mystem
+        long m_respawnDelay;
+        TimestampTz m_respawnAt;
+        TimestampTz m_lastMark; // end of the last accounted busy or idle period
+        int m_writeEventPos;
+        bool m_writeEventOn;
+        
+        mystemChild_t(uint8_t _workerNo, pg_ms::wordCache_t *_wordCache): m_workerNo(_workerNo), m_active(false),
+                m_pid(0), m_toMystem(-1), m_fromMystem(-1), m_reader(_wordCache), m_writePos(0), m_resultPending(false),
+                m_served(0), m_respawnDelay(0), m_respawnAt(0), m_lastMark(0), m_writeEventPos(-1),
+                m_writeEventOn(false) {}
+    };
+    
+    // Mystem processes driven from a single event loop with non-blocking pipes. Every process takes documents
+    // from the queue while there is room in its pipeline, so documents go to whichever process is idle.
+    // A dead mystem is started again after a backoff and the documents it was working on go back to the queue.
+    class mystemPool_t {
+    private:
+        pg_ms::inOutQueue_t &m_queue;
+        pg_ms::mystemStats_t *m_stats;
+        pg_ms::wordCache_t *m_wordCache;
+        std::vector<std::unique_ptr<mystemChild_t>> m_children;
+        WaitEventSet *m_waitSet;
+        bool m_waitSetStale; // processes were started or stopped since the set was built
+        std::string m_docLine;
+        std::string m_normLine; // output buffer, reused for every document
+        
+        static long minTimeout(long _timeout, long _other) {
+            return (_timeout < 0) ? _other : std::min(_timeout, _other);
+        }
+        
+        void deactivate(mystemChild_t &_child) {
+            m_queue.unregisterWorker(_child.m_workerNo);
+            if (m_stats != nullptr) {
+                m_stats->worker(_child.m_workerNo).m_pid.store(0);
+            }
+            _child.m_active = false;
+        }
+        
+        // stops mystem and returns its documents to the queue, a mystem that died is started again after a delay
+        // that doubles while mystem keeps dying before it processes a document
+        void stop(mystemChild_t &_child, bool _died) {
+            if (_child.m_pid > 0) {
+                stopMystem(_child.m_pid, _child.m_toMystem, _child.m_fromMystem);
+                m_waitSetStale = true;
+            }
+            _child.m_pid = 0;
+            for (auto &doc:_child.m_inFlight) {
+                m_queue.requeueRecord(doc.m_id, doc.m_doc);
+            }
+            _child.m_inFlight.clear();
+            _child.m_result.clear();
+            _child.m_resultPending = false;
+            _child.m_reader.reset();
+            _child.m_writeLine.clear();
+            _child.m_writePos = 0;
+            m_queue.setWorkerBusy(_child.m_workerNo);
+            
+            if (_died) {
+                if (m_stats != nullptr) {
+                    m_stats->worker(_child.m_workerNo).m_restarts.fetch_add(1, std::memory_order_relaxed);
+                }
+                _child.m_respawnDelay = (_child.m_served > 0) ? pg_ms::respawnDelayMin :
+                        std::min(std::max(_child.m_respawnDelay * 2, pg_ms::respawnDelayMin), pg_ms::respawnDelayMax);
+                _child.m_respawnAt = TimestampTzPlusMilliseconds(GetCurrentTimestamp(), _child.m_respawnDelay);
+                elog(LOG, "MYSTEM: mystem died, starting it again in %ld ms", _child.m_respawnDelay);
+            }
+            _child.m_served = 0;
+        }
+        
+        void start(mystemChild_t &_child) {
+            _child.m_pid = spawnMystem(_child.m_toMystem, _child.m_fromMystem);
+            if (_child.m_pid <= 0) {
+                _child.m_pid = 0;
+                stop(_child, true);
+                return;
+            }
+            _child.m_lastMark = GetCurrentTimestamp();
+            m_waitSetStale = true;
+        }
+        
+        // hands the result of the first document in flight over to its backend; if the arena has no room for it,
+        // the result stays pending on the child and is posted again once a slot is freed, so one full arena
+        // does not stop the other children
+        bool postResult(mystemChild_t &_child, std::string &_result) {
+            if (!m_queue.setOutQueueRecord(_child.m_inFlight.front().m_id, _result)) {
+                if (!_child.m_resultPending) {
+                    _child.m_result.swap(_result);
+                    _child.m_resultPending = true;
+                }
+                m_queue.waitForSlot();
+                return false;
+            }
+            _child.m_inFlight.pop_front();
+            _child.m_result.clear();
+            _child.m_resultPending = false;
+            ++_child.m_served;
+            
+            return true;
+        }
+        
+        // passes documents between the queue and mystem without blocking, returns false if mystem died
+        bool pump(mystemChild_t &_child, bool _retiring) {
+            // a child whose result is pending takes no more documents until it is posted
+            if (_child.m_resultPending) {
+                postResult(_child, _child.m_result);
+            }
+            
+            // take more documents while there is room in the pipeline
+            while (!_retiring && !_child.m_resultPending &&
+                   _child.m_inFlight.size() < static_cast<std::size_t>(pg_ms::pipelineDepth)) {
+                pg_ms::requestKind_t kind = pg_ms::REQUEST_TEXT;
+                uint64_t id = m_queue.getInQueueRecord(_child.m_workerNo, m_docLine, kind);
+                if (id == 0) {
+                    break;
+                }
+                _child.m_writeLine += m_docLine;
+                _child.m_inFlight.push_back(inFlightDoc_t{id, std::string(), kind, GetCurrentTimestamp(), 0});
+                _child.m_inFlight.back().m_doc.swap(m_docLine);
+            }
+            
+            bool mystemAlive = true;
+            if (_child.m_writePos < _child.m_writeLine.length()) {
+                ssize_t wrote = write(_child.m_toMystem, _child.m_writeLine.c_str() + _child.m_writePos,
+                                      _child.m_writeLine.length() - _child.m_writePos);
+                if (wrote > 0) {
+                    MYSTEM_PROBE2(pipe__write, _child.m_workerNo, wrote);
+                    _child.m_writePos += wrote;
+                } else if (wrote < 0 && errno != EAGAIN && errno != EINTR) {
+                    elog(LOG, "MYSTEM: write to mystem failed, errno = %d", errno);
+                    mystemAlive = false;
+                }
+                if (_child.m_writePos == _child.m_writeLine.length()) {
+                    _child.m_writeLine.clear();
+                    _child.m_writePos = 0;
+                    TimestampTz now = GetCurrentTimestamp();
+                    for (auto &doc:_child.m_inFlight) {
+                        if (doc.m_written == 0) {
+                            doc.m_written = now;
+                            if (m_stats != nullptr) {
+                                m_stats->addLatency(pg_ms::mystemStats_t::STAGE_PIPE_WRITE,
+                                                    pg_ms::elapsedUsecs(doc.m_taken, now));
+                            }
+                        }
+                    }
+                }
+            }
+            
+            if (mystemAlive) {
+                ssize_t red = _child.m_reader.fill(_child.m_fromMystem);
+                if (red == 0 || (red < 0 && errno != EAGAIN && errno != EINTR)) {
+                    elog(LOG, "MYSTEM: read from mystem failed");
+                    mystemAlive = false;
+                }
+            }
+            
+            // post finished documents
+            TimestampTz parseStart = GetCurrentTimestamp();
+            while (!_child.m_resultPending && !_child.m_inFlight.empty() &&
+                   _child.m_reader.nextDocument(m_normLine, _child.m_inFlight.front().m_kind)) {
+                inFlightDoc_t &doc = _child.m_inFlight.front();
+                MYSTEM_PROBE2(parse__done, doc.m_id, m_normLine.length());
+                if (m_stats != nullptr) {
+                    TimestampTz parsed = GetCurrentTimestamp();
+                    m_stats->addLatency(pg_ms::mystemStats_t::STAGE_MYSTEM,
+                                        pg_ms::elapsedUsecs(doc.m_written != 0 ? doc.m_written : doc.m_taken,
+                                                            parseStart));
+                    m_stats->addLatency(pg_ms::mystemStats_t::STAGE_PARSE, pg_ms::elapsedUsecs(parseStart, parsed));
+                    pg_ms::mystemStats_t::worker_t &worker = m_stats->worker(_child.m_workerNo);
+                    worker.m_documents.fetch_add(1, std::memory_order_relaxed);
+                    worker.m_bytes.fetch_add(doc.m_doc.length(), std::memory_order_relaxed);
+                }
+                postResult(_child, m_normLine);
+                m_normLine.clear();
+                parseStart = GetCurrentTimestamp();
+            }
+            
+            return mystemAlive;
+        }
+        
+        void buildWaitSet() {
+            if (m_waitSet != nullptr) {
+                FreeWaitEventSet(m_waitSet);
+            }
+            m_waitSet = CreateWaitEventSet(TopMemoryContext, 2 + 2 * m_children.size());
+            AddWaitEventToSet(m_waitSet, WL_LATCH_SET, PGINVALID_SOCKET, MyLatch, NULL);
+            AddWaitEventToSet(m_waitSet, WL_POSTMASTER_DEATH, PGINVALID_SOCKET, NULL, NULL);
+            for (auto &child:m_children) {
+                if (child->m_pid > 0) {
+                    AddWaitEventToSet(m_waitSet, WL_SOCKET_READABLE, child->m_fromMystem, NULL, NULL);
+                    child->m_writeEventPos = AddWaitEventToSet(m_waitSet, WL_SOCKET_WRITEABLE, child->m_toMystem,
+                                                               NULL, NULL);
+                    child->m_writeEventOn = true;
+                }
+            }
+            m_waitSetStale = false;
+        }
+        
+    public:
+        explicit mystemPool_t(pg_ms::inOutQueue_t &_queue): m_queue(_queue), m_stats(pg_ms::mystemStats_t::attach()),
+                m_wordCache(pg_ms::wordCache_t::attach(pg_ms::wordCacheSize * 1024L)), m_children(),
+                m_waitSet(nullptr), m_waitSetStale(true), m_docLine(), m_normLine() {
+            if (m_wordCache != nullptr) {
+                m_wordCache->mapSnapshot();
+            }
+        }
+        
+        // running mystem processes are stopped, the documents they were working on go back to the queue
+        ~mystemPool_t() {
+            for (auto &child:m_children) {
+                if (child->m_active) {
+                    stop(*child, false);
+                    deactivate(*child);
+                }
+            }
+            if (m_waitSet != nullptr) {
+                FreeWaitEventSet(m_waitSet);
+            }
+        }
+        
+        // starts serving the worker place, mystem is started by the next serve()
+        void activate(uint8_t _workerNo) {
+            mystemChild_t *child = nullptr;
+            for (auto &existing:m_children) {
+                if (existing->m_workerNo == _workerNo) {
+                    child = existing.get();
+                }
+            }
+            if (child == nullptr) {
+                m_children.emplace_back(new mystemChild_t(_workerNo, m_wordCache));
+                child = m_children.back().get();
+            }
+            child->m_active = true;
+            child->m_respawnDelay = 0;
+            child->m_respawnAt = 0;
+            m_queue.registerWorker(_workerNo, MyLatch);
+            if (m_stats != nullptr) {
+                m_stats->worker(_workerNo).m_pid.store(MyProcPid);
+            }
+        }
+        
+        bool isActive(uint8_t _workerNo) const {
+            for (auto &child:m_children) {
+                if (child->m_workerNo == _workerNo) {
+                    return child->m_active;
+                }
+            }
+            
+            return false;
+        }
+        
+        // places in use, retiring ones excluded
+        int running() const {
+            int running = 0;
+            for (auto &child:m_children) {
+                if (child->m_active && !m_queue.isRetiring(child->m_workerNo)) {
+                    ++running;
+                }
+            }
+            
+            return running;
+        }
+        
+        // one pass of the event loop: starts mystem processes that are due, passes documents and results,
+        // then sleeps until a pipe or the latch is ready, or _timeout milliseconds (-1 - no limit) pass;
+        // a retiring place takes no more documents and is released once its pipeline is drained
+        void serve(long _timeout) {
+            TimestampTz now = GetCurrentTimestamp();
+            for (auto &child:m_children) {
+                if (!child->m_active) {
+                    continue;
+                }
+                bool retiring = m_queue.isRetiring(child->m_workerNo);
+                if (child->m_pid == 0) {
+                    if (retiring) {
+                        deactivate(*child);
+                        continue;
+                    }
+                    if (child->m_respawnAt > now) {
+                        continue;
+                    }
+                    start(*child);
+                    if (child->m_pid == 0) {
+                        continue;
+                    }
+                }
+                if (retiring && child->m_inFlight.empty()) {
+                    stop(*child, false);
+                    deactivate(*child);
+                    continue;
+                }
+                if (!pump(*child, retiring)) {
+                    stop(*child, true);
+                    continue;
+                }
+                
+                // a freed slot sets our latch, the timeout covers a full wait ring
+                if (child->m_resultPending) {
+                    _timeout = minTimeout(_timeout, pg_ms::freeSlotWaitTimeout);
+                }
+                
+                // advertise free room in the pipeline, so submitters set our latch
+                if (!retiring && !child->m_resultPending &&
+                    child->m_inFlight.size() < static_cast<std::size_t>(pg_ms::pipelineDepth)) {
+                    if (!m_queue.setWorkerIdle(child->m_workerNo)) {
+                        _timeout = 0;
+                    }
+                } else {
+                    m_queue.setWorkerBusy(child->m_workerNo);
+                }
+            }
+            
+            // a dead mystem wakes the loop up when it is due to start again
+            for (auto &child:m_children) {
+                if (child->m_active && child->m_pid == 0) {
+                    long secs = 0;
+                    int usecs = 0;
+                    TimestampDifference(GetCurrentTimestamp(), child->m_respawnAt, &secs, &usecs);
+                    _timeout = minTimeout(_timeout, secs * 1000 + usecs / 1000 + 1);
+                }
+            }
+            
+            if (m_waitSet == nullptr || m_waitSetStale) {
+                buildWaitSet();
+            }
+            for (auto &child:m_children) {
+                bool writePending = (child->m_pid > 0 && child->m_writePos < child->m_writeLine.length());
+                if (child->m_pid > 0 && writePending != child->m_writeEventOn) {
+                    ModifyWaitEvent(m_waitSet, child->m_writeEventPos, writePending ? WL_SOCKET_WRITEABLE : 0, NULL);
+                    child->m_writeEventOn = writePending;
+                }
+            }
+            
+            WaitEvent event;
+            TimestampTz waitStart = GetCurrentTimestamp();
+            if (WaitEventSetWait(m_waitSet, _timeout, &event, 1) > 0) {
+                if (event.events & WL_LATCH_SET) {
+                    ResetLatch(MyLatch);
+                }
+                if (event.events & WL_POSTMASTER_DEATH) {
+                    proc_exit(1);
+                }
+            }
+            
+            // waiting with an empty pipeline is idle time, the rest is busy time
+            if (m_stats != nullptr) {
+                TimestampTz now = GetCurrentTimestamp();
+                for (auto &child:m_children) {
+                    if (child->m_pid == 0) {
+                        continue;
+                    }
+                    pg_ms::mystemStats_t::worker_t &worker = m_stats->worker(child->m_workerNo);
+                    if (child->m_inFlight.empty()) {
+                        worker.m_busyTime.fetch_add(pg_ms::elapsedUsecs(child->m_lastMark, waitStart),
+                                                    std::memory_order_relaxed);
+                        worker.m_idleTime.fetch_add(pg_ms::elapsedUsecs(waitStart, now), std::memory_order_relaxed);
+                    } else {
+                        worker.m_busyTime.fetch_add(pg_ms::elapsedUsecs(child->m_lastMark, now),
+                                                    std::memory_order_relaxed);
+                    }
+                    child->m_lastMark = now;
+                }
+            }
+        }
+    };
+    
+    void createMystemChilds(Datum _arg) {
+        pqsignal(SIGTERM, mystemSigterm);
+        BackgroundWorkerUnblockSignals();
+        
+        try {
+            pg_ms::inOutQueue_t inOutQueue;
+            if (!inOutQueue.isOK()) {
+                elog(ERROR, "MYSTEM: failed to attach queue");
+                proc_exit(1);
+            }
+            
+            elog(LOG, "MYSTEM: initialized");
+            
+            // the worker serves a single place until it is retired or terminated
+            mystemPool_t pool(inOutQueue);
+            uint8_t workerNo = static_cast<uint8_t>(DatumGetInt32(_arg));
+            pool.activate(workerNo);
+            while (!mystemTerminated && pool.isActive(workerNo)) {
+                pool.serve(-1L);
+            }
+        } catch (const std::exception &_e) {
+            elog(LOG, "MYSTEM: critical error: %s", _e.what());
+        } catch (...) {
+            elog(LOG, "MYSTEM: unknown critical");
+        }
+        
+        elog(LOG, "MYSTEM: worker is shutting down");
+        proc_exit(0);
+    }
+    
+    // decides how many mystem processes the load needs, about once per scaleInterval: more of them when documents
+    // wait longer than scaleUpWait or outnumber the room in the pipelines, one less after scaleDownTicks quiet ticks
+    class workerScaler_t {
+    private:
+        TimestampTz m_lastScale;
+        uint64_t m_lastTaken;
+        uint64_t m_lastWaitTime;
+        int m_quietTicks;
+        
+    public:
+        workerScaler_t(): m_lastScale(GetCurrentTimestamp()), m_lastTaken(0), m_lastWaitTime(0), m_quietTicks(0) {}
+        
+        // returns the number of processes to start, -1 if one should be retired
+        int tick(pg_ms::inOutQueue_t &_queue, int _running, int _minRunning) {
+            TimestampTz now = GetCurrentTimestamp();
+            if (!TimestampDifferenceExceeds(m_lastScale, now, pg_ms::scaleInterval)) {
+                return 0;
+            }
+            m_lastScale = now;
+            uint64_t taken = 0;
+            uint64_t waitTime = 0;
+            _queue.waitStats(taken, waitTime);
+            uint64_t avgWait = (taken > m_lastTaken) ? (waitTime - m_lastWaitTime) / (taken - m_lastTaken) : 0;
+            m_lastTaken = taken;
+            m_lastWaitTime = waitTime;
+            
+            uint64_t pending = _queue.pending();
+            uint64_t capacity = static_cast<uint64_t>(_running) * pg_ms::pipelineDepth;
+            if (pending > capacity || (pending > 0 && avgWait >= pg_ms::scaleUpWait)) {
+                m_quietTicks = 0;
+                uint64_t wanted = std::max(pending / pg_ms::pipelineDepth, static_cast<uint64_t>(1));
+                return static_cast<int>(std::min(wanted, static_cast<uint64_t>(pg_ms::maxWorkers - _running)));
+            }
+            if (pending == 0 && avgWait < pg_ms::scaleUpWait) {
+                if (++m_quietTicks >= pg_ms::scaleDownTicks && _running > _minRunning) {
+                    return -1;
+                }
+            } else {
+                m_quietTicks = 0;
+            }
+            
+            return 0;
+        }
+    };
+    
+    // starts a mystem worker in the first free place of the pool,
+    // returns false if the pool is full or the postmaster is out of background worker slots
+    static bool startMystemWorker(pg_ms::inOutQueue_t &_queue, BackgroundWorkerHandle **_handles) {
+        for (int i = 0; i < pg_ms::maxWorkers; ++i) {
+            if (_handles[i] != NULL) {
+                continue;
+            }
+            
+            BackgroundWorker worker;
+            worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+            worker.bgw_start_time = BgWorkerStart_ConsistentState;
+            worker.bgw_restart_time = BGW_NEVER_RESTART;
+            worker.bgw_main = createMystemChilds;
+            worker.bgw_main_arg = Int32GetDatum(i);
+            worker.bgw_notify_pid = MyProcPid;
+            sprintf(worker.bgw_name, "mystem wrapper process %d", i + 1);
+            
+            _queue.resetWorker(static_cast<uint8_t>(i));
+            if (!RegisterDynamicBackgroundWorker(&worker, &_handles[i])) {
+                _handles[i] = NULL;
+                return false;
+            }
+            return true;
+        }
+        
+        return false;
+    }
+    
+    // process mode: a background worker per mystem process
+    // frees documents of backends that have exited without waiting for them, once per scaleInterval
+    static void sweepOrphans(pg_ms::inOutQueue_t &_queue, TimestampTz &_lastSweep) {
+        TimestampTz now = GetCurrentTimestamp();
+        if (!TimestampDifferenceExceeds(_lastSweep, now, pg_ms::scaleInterval)) {
+            return;
+        }
+        _lastSweep = now;
+        uint32_t reclaimed = _queue.reclaimOrphans();
+        if (reclaimed > 0) {
+            elog(LOG, "MYSTEM: reclaimed %u documents of exited backends", reclaimed);
+        }
+    }
+    
+    // snapshots the word cache once per pg_mystem.word_cache_snapshot_interval if new words were learned,
+    // or at once if _force is set
+    static void saveWordSnapshot(TimestampTz &_lastSave, uint64_t &_savedInsertions, bool _force = false) {
+        pg_ms::wordCache_t *cache = pg_ms::wordCache_t::attach(pg_ms::wordCacheSize * 1024L);
+        TimestampTz now = GetCurrentTimestamp();
+        if (cache == nullptr || pg_ms::wordSnapshotInterval == 0 || cache->insertions() == _savedInsertions ||
+            (!_force && !TimestampDifferenceExceeds(_lastSave, now, pg_ms::wordSnapshotInterval * 1000))) {
+            return;
+        }
+        _lastSave = now;
+        _savedInsertions = cache->insertions();
+        try {
+            std::vector<pg_ms::wordSnapshot_t::pair_t> pairs;
+            cache->collect(pairs);
+            if (pg_ms::wordSnapshot_t::save(pairs)) {
+                cache->snapshotSaved();
+            }
+        } catch (const std::exception &_e) {
+            elog(LOG, "MYSTEM: word cache snapshot failed: %s", _e.what());
         }
+    }
+    
+    static void superviseWorkers(pg_ms::inOutQueue_t &_queue) {
+        BackgroundWorkerHandle *handles[pg_ms::workersMax] = {};
+        bool retiring[pg_ms::workersMax] = {};
+        workerScaler_t scaler;
+        TimestampTz lastSweep = GetCurrentTimestamp();
+        TimestampTz lastSave = lastSweep;
+        uint64_t savedInsertions = 0;
         
-        pid_t derivedPid = fork();
-        switch (derivedPid) {
-            case 0: {
-                // child continues here
-                close(STDOUT_FILENO);
-                close(STDIN_FILENO);
-                // redirect stdin, stdout, stderr
-                if ((dup2(stdoutPipe[0], STDIN_FILENO) == -1) || (dup2(stdinPipe[1], STDOUT_FILENO) == -1)) {
-                    elog(ERROR, "MYSTEM: IO redirection failed, errno = %d", errno);
-                    proc_exit(1);
+        while (!mystemTerminated) {
+            if (mystemReloadConfig) {
+                mystemReloadConfig = false;
+                ProcessConfigFile(PGC_SIGHUP);
+            }
+            
+            // forget stopped workers, retired ones as well as crashed ones, and fail documents they left
+            int running = 0;
+            for (int i = 0; i < pg_ms::maxWorkers; ++i) {
+                pid_t pid;
+                if (handles[i] != NULL && GetBackgroundWorkerPid(handles[i], &pid) == BGWH_STOPPED) {
+                    _queue.reclaimWorkerRecords(static_cast<uint8_t>(i));
+                    pg_ms::mystemStats_t *stats = pg_ms::mystemStats_t::attach();
+                    if (stats != nullptr) {
+                        stats->worker(static_cast<uint8_t>(i)).m_pid.store(0);
+                    }
+                    pfree(handles[i]);
+                    handles[i] = NULL;
+                    retiring[i] = false;
                 }
-                close(stdoutPipe[0]);
-                close(stdoutPipe[1]);
-                close(stdinPipe[0]);
-                close(stdinPipe[1]);
-                
-                // run child process image
-                std::string path = std::string(SHARE_FOLDER_STR) + "/mystem";
-                execle(path.c_str(), path.c_str(), "-cd", "--format", "json", NULL, NULL);
+                if (handles[i] != NULL && !retiring[i]) {
+                    ++running;
+                }
+            }
+            sweepOrphans(_queue, lastSweep);
+            saveWordSnapshot(lastSave, savedInsertions);
+            
+            int minRunning = pg_ms::minRunningWorkers();
+            while (running < minRunning && startMystemWorker(_queue, handles)) {
+                ++running;
+            }
+            
+            int change = scaler.tick(_queue, running, minRunning);
+            for (int i = 0; i < change && startMystemWorker(_queue, handles); ++i) {
+                ++running;
+            }
+            for (int i = pg_ms::maxWorkers - 1; change < 0 && i >= 0; --i) {
+                if (handles[i] != NULL && !retiring[i]) {
+                    _queue.retireWorker(static_cast<uint8_t>(i));
+                    retiring[i] = true;
+                    break;
+                }
+            }
+            
+            // workers notify the launcher when they start and stop
+            int rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, pg_ms::scaleInterval);
+            ResetLatch(MyLatch);
+            if (rc & WL_POSTMASTER_DEATH) {
+                return;
+            }
+        }
+        saveWordSnapshot(lastSave, savedInsertions, true);
+    }
+    
+    // multiplexed mode: the launcher drives all mystem processes itself
+    static void serveMultiplexed(pg_ms::inOutQueue_t &_queue) {
+        try {
+            mystemPool_t pool(_queue);
+            workerScaler_t scaler;
+            TimestampTz lastSweep = GetCurrentTimestamp();
+            TimestampTz lastSave = lastSweep;
+            uint64_t savedInsertions = 0;
+            
+            while (!mystemTerminated) {
+                if (mystemReloadConfig) {
+                    mystemReloadConfig = false;
+                    ProcessConfigFile(PGC_SIGHUP);
+                }
+                sweepOrphans(_queue, lastSweep);
+                saveWordSnapshot(lastSave, savedInsertions);
                 
-                // if we get here at all, an error occurred, but we are in the child
-                // process, so just exit
-                elog(ERROR, "MYSTEM: exec of the child process failed (%s), errno = %d", path.c_str(), errno);
-                proc_exit(1);
-            } case -1: {
-                // failed to create child
-                close(stdoutPipe[0]);
-                close(stdoutPipe[1]);
-                close(stdinPipe[0]);
-                close(stdinPipe[1]);
-                elog(ERROR, "MYSTEM: failed to create child, errno=%d", errno);
-                proc_exit(1);
-            } default: {
-                // parent continues here
-                close(stdoutPipe[0]);
-                close(stdinPipe[1]);
-
-                pqsignal(SIGTERM, mystemSigterm);
-                BackgroundWorkerUnblockSignals();
-
-                try {
-                    pg_ms::inOutQueue_t inOutQueue;
-                    if (!inOutQueue.isOK()) {
-                        elog(ERROR, "MYSTEM: failed to attach queue");
-                        proc_exit(1);
+                int running = pool.running();
+                int minRunning = pg_ms::minRunningWorkers();
+                int change = scaler.tick(_queue, running, minRunning);
+                int wanted = std::max(minRunning - running, change);
+                for (int i = 0; i < pg_ms::maxWorkers && wanted > 0; ++i) {
+                    if (!pool.isActive(static_cast<uint8_t>(i))) {
+                        _queue.resetWorker(static_cast<uint8_t>(i));
+                        pool.activate(static_cast<uint8_t>(i));
+                        --wanted;
                     }
-                    
-                    elog(LOG, "MYSTEM: initialized");
-                    
-                    long currTimeout = 0;
-                    while (!mystemTerminated) {
-                        std::string writeLine;
-                        uint64_t id = inOutQueue.getInQueueRecord(writeLine);
-                        std::string normLine;
-                        if (id > 0) {
-                            currTimeout = 0;
-                            if (writeLine.length() > 0) {
-                                std::size_t ttl = 0;
-                                while (true) {
-                                    ssize_t wrote = write(stdoutPipe[1], writeLine.c_str() + ttl, writeLine.length() - ttl);
-                                    if (wrote < 0) {
-                                        elog(LOG, "MYSTEM: write to mystem failed");
-                                        break;
-                                    }
-                                    ttl += wrote;
-                                    if (wrote == 0 || ttl >= writeLine.length()) {
-                                        break;
-                                    }
-                                }
-                                
-                                std::vector<std::string> normLines;
-                                std::string readLine;
-                                char rChar = 0;
-                                while (true) {
-                                    ssize_t red = read(stdinPipe[0], &rChar, sizeof(rChar));
-                                    if (red > 0) {
-                                        if (rChar == '\n') {
-                                            if (readLine.find(pg_ms::mystemParagraphEndMarker) != std::string::npos) {
-                                                normLines.push_back(readLine);
-                                                readLine.clear();
-                                                break;
-                                            } else {
-                                                normLines.push_back(readLine);
-                                                readLine.clear();
-                                            }
-                                        } else {
-                                            readLine += rChar;
-                                        }
-                                    } else if (red <= 0) {
-                                        break;
-                                    }
-                                }
-                                
-                                for (auto nli:normLines) {
-                                    rapidjson::Document jsonDoc;
-                                    jsonDoc.Parse<0>(nli.c_str());
-                                    if (jsonDoc.IsArray()) {
-                                        const rapidjson::Value &array = jsonDoc;
-                                        for (rapidjson::SizeType i = 0; i < array.Size(); ++i) {
-                                            std::string anlsStr;
-                                            if (array[i].HasMember("analysis")) {
-                                                if (array[i]["analysis"].IsArray()) {
-                                                    const rapidjson::Value &analysis = array[i]["analysis"];
-                                                    for (rapidjson::SizeType j = 0; j < analysis.Size(); ++j) {
-                                                        if (analysis[j].HasMember("lex")) {
-                                                            anlsStr = analysis[j]["lex"].GetString();
-                                                        } else {
-                                                            elog(LOG, "MYSTEM: JSON format error");
-                                                            break;
-                                                        }
-                                                    }
-                                                } else {
-                                                    elog(LOG, "MYSTEM: JSON format error");
-                                                    break;
-                                                }
-                                            }
-                                            if (array[i].HasMember("text")) {
-                                                if (anlsStr.length() == 0) {
-                                                    std::string text = array[i]["text"].GetString();
-                                                    if (text != pg_ms::mystemParagraphEndMarker && text != "\n") {
-                                                        std::replace(text.begin(), text.end(), '\n', ' ');
-                                                        normLine += text;
-                                                    }
-                                                } else {
-                                                    normLine += anlsStr;
-                                                }
-                                            } else {
-                                                elog(LOG, "MYSTEM: JSON format error");
-                                                break;
-                                            }
-                                        }
-                                    } else {
-                                        elog(LOG, "MYSTEM: JSON parsing failed");
-                                    }
-                                }
-                            }
-                            
-                            while (true) {
-                                if (inOutQueue.setOutQueueRecord(id, normLine)) {
-                                    break;
-                                } else {
-                                    usleep(1L);
-                                }
-                            }
-                        }
-                        
-                        currTimeout = (currTimeout + 1) * 2;
-                        if (currTimeout > pg_ms::queueWaitTimeoutMax) {
-                            currTimeout = pg_ms::queueWaitTimeoutMax;
-                        }
-                        
-                        int rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, currTimeout);
-                        ResetLatch(MyLatch);
-                        if (rc & WL_POSTMASTER_DEATH) {
-                            break;
-                        }
+                }
+                for (int i = pg_ms::maxWorkers - 1; change < 0 && i >= 0; --i) {
+                    if (pool.isActive(static_cast<uint8_t>(i)) && !_queue.isRetiring(static_cast<uint8_t>(i))) {
+                        _queue.retireWorker(static_cast<uint8_t>(i));
+                        break;
                     }
-                } catch (const std::exception &_e) {
-                    elog(LOG, "MYSTEM: critical error: %s", _e.what());
-                } catch (...) {
-                    elog(LOG, "MYSTEM: unknown critical");
                 }
                 
-                elog(LOG, "MYSTEM: worker is shutting down");
-                close(stdinPipe[0]);
-                close(stdoutPipe[1]);
-                proc_exit(0);
+                pool.serve(pg_ms::scaleInterval);
             }
+            saveWordSnapshot(lastSave, savedInsertions, true);
+        } catch (const std::exception &_e) {
+            elog(LOG, "MYSTEM: critical error: %s", _e.what());
+        } catch (...) {
+            elog(LOG, "MYSTEM: unknown critical");
         }
     }
-
+    
     void mainMystemProc(Datum) {
-        if (!pg_ms::inOutQueue_t::init()) {
-            elog(ERROR, "MYSTEM: queue initialisation failed");
+        pqsignal(SIGTERM, mystemSigterm);
+        pqsignal(SIGHUP, mystemSighup);
+        BackgroundWorkerUnblockSignals();
+        
+        pg_ms::inOutQueue_t inOutQueue;
+        if (!inOutQueue.isOK()) {
+            elog(ERROR, "MYSTEM: failed to attach queue");
             proc_exit(1);
         }
         
-        BackgroundWorker worker;
-        worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
-        worker.bgw_start_time = BgWorkerStart_ConsistentState;
-        worker.bgw_restart_time = BGW_NEVER_RESTART;
-        worker.bgw_main = createMystemChilds;
-        
-        for (auto i = 0; i < pg_ms::mystemProcNo; ++i) {
-            sprintf(worker.bgw_name, "mystem wrapper process %d", i + 1);
-            RegisterDynamicBackgroundWorker(&worker, NULL);
-        }
-
-        pqsignal(SIGTERM, mystemSigterm);
-        BackgroundWorkerUnblockSignals();
-
-        while (!mystemTerminated) {
-            int rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, 1000L);
-            ResetLatch(MyLatch);
-            if (rc & WL_POSTMASTER_DEATH) {
-                break;
-            }
+        if (pg_ms::workerMode == pg_ms::WORKER_MODE_MULTIPLEXED) {
+            serveMultiplexed(inOutQueue);
+        } else {
+            superviseWorkers(inOutQueue);
         }
-
+        
         elog(LOG, "MYSTEM: launcher is shutting down");
         
-        pg_ms::inOutQueue_t::release();
         proc_exit(0);
     }
     
+    static shmem_startup_hook_type prevShmemStartupHook = NULL;
+    
+    static void mystemShmemStartup(void) {
+        if (prevShmemStartupHook) {
+            prevShmemStartupHook();
+        }
+        
+        LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+        pg_ms::inOutQueue_t::init();
+        pg_ms::mystemStats_t::init();
+        pg_ms::wordCache_t::init(pg_ms::wordCacheSize * 1024L);
+        pg_ms::resultCache_t::init(pg_ms::resultCacheSize * 1024L);
+        LWLockRelease(AddinShmemInitLock);
+    }
+    
     void _PG_init(void) {
+        if (!process_shared_preload_libraries_in_progress) {
+            return;
+        }
+        
+        DefineCustomIntVariable("pg_mystem.min_workers",
+                                "Number of mystem processes kept running when there is no load.",
+                                NULL, &pg_ms::minWorkers, pg_ms::minWorkers, 1, pg_ms::workersMax,
+                                PGC_SIGHUP, 0, NULL, NULL, NULL);
+        DefineCustomIntVariable("pg_mystem.max_workers",
+                                "Maximum number of mystem processes started under load.",
+                                NULL, &pg_ms::maxWorkers, pg_ms::maxWorkers, 1, pg_ms::workersMax,
+                                PGC_POSTMASTER, 0, NULL, NULL, NULL);
+        DefineCustomEnumVariable("pg_mystem.worker_mode",
+                                 "How mystem processes are driven: process or multiplexed.",
+                                 NULL, &pg_ms::workerMode, pg_ms::workerMode, pg_ms::workerModes,
+                                 PGC_POSTMASTER, 0, NULL, NULL, NULL);
+        DefineCustomEnumVariable("pg_mystem.protocol",
+                                 "Output format of mystem: json or the leaner text.",
+                                 NULL, &pg_ms::mystemProtocol, pg_ms::mystemProtocol, pg_ms::mystemProtocols,
+                                 PGC_POSTMASTER, 0, NULL, NULL, NULL);
+        DefineCustomIntVariable("pg_mystem.interactive_workers",
+                                "Number of mystem processes that take short documents only.",
+                                NULL, &pg_ms::interactiveWorkers, pg_ms::interactiveWorkers, 0, pg_ms::workersMax,
+                                PGC_POSTMASTER, 0, NULL, NULL, NULL);
+        DefineCustomEnumVariable("pg_mystem.priority",
+                                 "Queue lane of the session documents: auto (by size), interactive or bulk.",
+                                 NULL, &pg_ms::priority, pg_ms::priority, pg_ms::priorities,
+                                 PGC_USERSET, 0, NULL, NULL, NULL);
+        DefineCustomIntVariable("pg_mystem.max_doc_len",
+                                "Documents longer than this are split into chunks processed in parallel.",
+                                NULL, &pg_ms::docLengthMax, pg_ms::docLengthMax, 1,
+                                static_cast<int>(MaxAllocSize - pg_ms::docPostfixLength),
+                                PGC_SIGHUP, 0, NULL, NULL, NULL);
+        DefineCustomIntVariable("pg_mystem.queue_memory",
+                                "Shared memory for documents and results in flight.",
+                                NULL, &pg_ms::queueMemory, pg_ms::queueMemory, 64, INT_MAX / 1024,
+                                PGC_POSTMASTER, GUC_UNIT_KB, NULL, NULL, NULL);
+        DefineCustomIntVariable("pg_mystem.request_timeout",
+                                "Longest wait for mystem results before mystem_convert fails, 0 disables the limit.",
+                                NULL, &pg_ms::requestTimeout, pg_ms::requestTimeout, 0, INT_MAX,
+                                PGC_USERSET, GUC_UNIT_MS, NULL, NULL, NULL);
+        DefineCustomIntVariable("pg_mystem.pipeline_depth",
+                                "Number of documents each mystem process works on at once.",
+                                NULL, &pg_ms::pipelineDepth, pg_ms::pipelineDepth, 1, pg_ms::pipelineDepthMax,
+                                PGC_POSTMASTER, 0, NULL, NULL, NULL);
+        DefineCustomIntVariable("pg_mystem.word_cache_size",
+                                "Shared memory for word forms and their lemmas learned from mystem, 0 disables the cache.",
+                                NULL, &pg_ms::wordCacheSize, pg_ms::wordCacheSize, 0, INT_MAX / 1024,
+                                PGC_POSTMASTER, GUC_UNIT_KB, NULL, NULL, NULL);
+        DefineCustomIntVariable("pg_mystem.word_cache_snapshot_interval",
+                                "Interval of word cache snapshots used after a restart, 0 disables the snapshot.",
+                                NULL, &pg_ms::wordSnapshotInterval, pg_ms::wordSnapshotInterval, 0, INT_MAX / 1000,
+                                PGC_SIGHUP, GUC_UNIT_S, NULL, NULL, NULL);
+        DefineCustomEnumVariable("pg_mystem.word_cache_mode",
+                                 "How mystem_convert uses the word cache: off, context or tokens.",
+                                 NULL, &pg_ms::wordCacheMode, pg_ms::wordCacheMode, pg_ms::wordCacheModes,
+                                 PGC_USERSET, 0, NULL, NULL, NULL);
+        DefineCustomIntVariable("pg_mystem.result_cache_size",
+                                "Shared memory for whole mystem_convert results, 0 disables the cache.",
+                                NULL, &pg_ms::resultCacheSize, pg_ms::resultCacheSize, 0, INT_MAX / 1024,
+                                PGC_POSTMASTER, GUC_UNIT_KB, NULL, NULL, NULL);
+        EmitWarningsOnPlaceholders("pg_mystem");
+        
+        RequestAddinShmemSpace(pg_ms::inOutQueue_t::shmemSize());
+        RequestAddinShmemSpace(pg_ms::mystemStats_t::size());
+        RequestAddinShmemSpace(pg_ms::wordCache_t::size(pg_ms::wordCacheSize * 1024L));
+        if (pg_ms::resultCache_t::size(pg_ms::resultCacheSize * 1024L) > 0) {
+            RequestAddinShmemSpace(pg_ms::resultCache_t::size(pg_ms::resultCacheSize * 1024L));
+            RequestNamedLWLockTranche(pg_ms::resultCache_t::trancheName, pg_ms::resultCache_t::partitionsNo);
+        }
+        for (uint32_t i = 0; i < pg_ms::inOutQueue_t::WAIT_EVENTS_NO; ++i) {
+            RequestNamedLWLockTranche(pg_ms::inOutQueue_t::waitEventNames[i], 1);
+        }
+        prevShmemStartupHook = shmem_startup_hook;
+        shmem_startup_hook = mystemShmemStartup;
+        
         BackgroundWorker worker;
         
         sprintf(worker.bgw_name, "mystem wrapper launcher process");
@@ -566,6 +4470,13 @@ extern "C" {
         RegisterBackgroundWorker(&worker);
     }
     
+    // raises the error of a failed request; a request given up because of a cancel or a termination
+    // reports that instead
+    static void reportError(const char *_error) {
+        CHECK_FOR_INTERRUPTS();
+        elog(ERROR, "MYSTEM: %s", _error);
+    }
+    
     PG_FUNCTION_INFO_V1(mystem_convert);
     Datum mystem_convert(PG_FUNCTION_ARGS) {
         if (PG_ARGISNULL(0)) {
@@ -573,40 +4484,504 @@ extern "C" {
         }
         
         std::string nrmLine;
+        char *error = nullptr;
         try {
-            text *_line = PG_GETARG_TEXT_P(0);
-            std::string line(VARDATA(_line), VARSIZE(_line) - VARHDRSZ);
+            text *_line = PG_GETARG_TEXT_PP(0);
+            const char *lineData = VARDATA_ANY(_line);
+            std::size_t lineLength = VARSIZE_ANY_EXHDR(_line);
             
-            if (line.length() > 0) {
-                pg_ms::inOutQueue_t inOutQueue;
-                if (!inOutQueue.isOK()) {
+            if (lineLength > 0) {
+                pg_ms::inOutQueue_t *inOutQueue = pg_ms::attachBackendQueue();
+                if (inOutQueue == nullptr) {
                     PG_RETURN_NULL();
                 }
                 
-                uint64_t id = 0;
-                while (true) {
-                    id = inOutQueue.setInQueueRecord(line);
-                    if (id != 0) {
-                        break;
-                    } else {
-                        usleep(1L);
-                    }
+                text *result = pg_ms::convertText(inOutQueue, lineData, lineLength);
+                if (result != nullptr) {
+                    PG_RETURN_TEXT_P(result);
                 }
                 
-                while (true) {
-                    if (inOutQueue.getOutQueueRecord(id, nrmLine)) {
-                        break;
-                    } else {
-                        usleep(1L);
-                    }
-                }
+                std::vector<std::string> docs(1, std::string(lineData, lineLength));
+                std::vector<std::string> results;
+                pg_ms::convertDocuments(inOutQueue, docs, results);
+                nrmLine.swap(results[0]);
             }
+        } catch (const pg_ms::mystemError_t &_e) {
+            error = pstrdup(_e.what());
         } catch (const std::exception &_e) {
             elog(LOG, "MYSTEM: mystem_convert critical error: %s", _e.what());
         } catch (...) {
             elog(LOG, "MYSTEM: mystem_convert unknown critical error");
         }
+        if (error != nullptr) {
+            reportError(error);
+        }
 
-        PG_RETURN_TEXT_P(cstring_to_text(nrmLine.c_str()));
+        PG_RETURN_TEXT_P(cstring_to_text_with_len(nrmLine.c_str(), nrmLine.length()));
+    }
+    
+    PG_FUNCTION_INFO_V1(mystem_convert_array);
+    Datum mystem_convert_array(PG_FUNCTION_ARGS) {
+        ArrayType *array = PG_GETARG_ARRAYTYPE_P(0);
+        bool *nulls = nullptr;
+        int count = 0;
+        char *error = nullptr;
+        Datum *results = pg_ms::convertTextArray(array, &nulls, &count, &error);
+        if (error != nullptr) {
+            reportError(error);
+        }
+        if (results == nullptr) {
+            PG_RETURN_NULL();
+        }
+        
+        PG_RETURN_ARRAYTYPE_P(construct_md_array(results, nulls, ARR_NDIM(array), ARR_DIMS(array), ARR_LBOUND(array),
+                                                 TEXTOID, -1, false, 'i'));
+    }
+    
+    // text search parser: the whole document is converted by mystem with one request on start,
+    // then tokens are returned one by one
+    enum {
+        MYSTEM_TOKEN_LEMMA = 1,
+        MYSTEM_TOKEN_WORD = 2
+    };
+    
+    struct parserState_t {
+        char *m_tokens;
+        int m_length;
+        int m_pos;
+    };
+    
+    PG_FUNCTION_INFO_V1(mystem_prs_start);
+    Datum mystem_prs_start(PG_FUNCTION_ARGS) {
+        parserState_t *state = (parserState_t *) palloc0(sizeof(parserState_t));
+        char *error = nullptr;
+        state->m_tokens = pg_ms::convertToTokens((char *) PG_GETARG_POINTER(0), PG_GETARG_INT32(1), &state->m_length,
+                                                 &error);
+        if (error != nullptr) {
+            reportError(error);
+        }
+        
+        PG_RETURN_POINTER(state);
+    }
+    
+    PG_FUNCTION_INFO_V1(mystem_prs_nexttoken);
+    Datum mystem_prs_nexttoken(PG_FUNCTION_ARGS) {
+        parserState_t *state = (parserState_t *) PG_GETARG_POINTER(0);
+        char **token = (char **) PG_GETARG_POINTER(1);
+        int *tokenLength = (int *) PG_GETARG_POINTER(2);
+        
+        while (state->m_pos < state->m_length) {
+            char *line = state->m_tokens + state->m_pos;
+            char *lineEnd = static_cast<char *>(memchr(line, '\n', state->m_length - state->m_pos));
+            int lineLength = (lineEnd == nullptr) ? state->m_length - state->m_pos : lineEnd - line;
+            state->m_pos += lineLength + 1;
+            if (lineLength < 2) {
+                continue;
+            }
+            *token = line + 1;
+            *tokenLength = lineLength - 1;
+            PG_RETURN_INT32(line[0] == pg_ms::tokenLemma ? MYSTEM_TOKEN_LEMMA : MYSTEM_TOKEN_WORD);
+        }
+        
+        PG_RETURN_INT32(0);
+    }
+    
+    PG_FUNCTION_INFO_V1(mystem_prs_end);
+    Datum mystem_prs_end(PG_FUNCTION_ARGS) {
+        parserState_t *state = (parserState_t *) PG_GETARG_POINTER(0);
+        if (state->m_tokens != nullptr) {
+            pfree(state->m_tokens);
+        }
+        pfree(state);
+        
+        PG_RETURN_VOID();
+    }
+    
+    PG_FUNCTION_INFO_V1(mystem_prs_lextype);
+    Datum mystem_prs_lextype(PG_FUNCTION_ARGS) {
+        LexDescr *descr = (LexDescr *) palloc(sizeof(LexDescr) * 3);
+        descr[0].lexid = MYSTEM_TOKEN_LEMMA;
+        descr[0].alias = pstrdup("lemma");
+        descr[0].descr = pstrdup("Word lemmatized by mystem");
+        descr[1].lexid = MYSTEM_TOKEN_WORD;
+        descr[1].alias = pstrdup("word");
+        descr[1].descr = pstrdup("Word unknown to mystem");
+        descr[2].lexid = 0;
+        
+        PG_RETURN_POINTER(descr);
+    }
+    
+    struct convertSetState_t {
+        Datum *m_results;
+        bool *m_nulls;
+    };
+    
+    PG_FUNCTION_INFO_V1(mystem_convert_set);
+    Datum mystem_convert_set(PG_FUNCTION_ARGS) {
+        FuncCallContext *funcCtx;
+        if (SRF_IS_FIRSTCALL()) {
+            funcCtx = SRF_FIRSTCALL_INIT();
+            MemoryContext oldCtx = MemoryContextSwitchTo(funcCtx->multi_call_memory_ctx);
+            
+            TupleDesc tupleDesc;
+            if (get_call_result_type(fcinfo, NULL, &tupleDesc) != TYPEFUNC_COMPOSITE) {
+                elog(ERROR, "MYSTEM: return type must be a row type");
+            }
+            funcCtx->tuple_desc = BlessTupleDesc(tupleDesc);
+            
+            convertSetState_t *state = (convertSetState_t *) palloc(sizeof(convertSetState_t));
+            int count = 0;
+            char *error = nullptr;
+            state->m_results = pg_ms::convertTextArray(PG_GETARG_ARRAYTYPE_P(0), &state->m_nulls, &count, &error);
+            if (error != nullptr) {
+                reportError(error);
+            }
+            funcCtx->max_calls = (state->m_results == nullptr) ? 0 : count;
+            funcCtx->user_fctx = state;
+            
+            MemoryContextSwitchTo(oldCtx);
+        }
+        
+        funcCtx = SRF_PERCALL_SETUP();
+        if (funcCtx->call_cntr < funcCtx->max_calls) {
+            convertSetState_t *state = (convertSetState_t *) funcCtx->user_fctx;
+            Datum values[2];
+            bool nulls[2] = {false, state->m_nulls[funcCtx->call_cntr]};
+            values[0] = Int32GetDatum(funcCtx->call_cntr + 1);
+            values[1] = state->m_results[funcCtx->call_cntr];
+            HeapTuple tuple = heap_form_tuple(funcCtx->tuple_desc, values, nulls);
+            SRF_RETURN_NEXT(funcCtx, HeapTupleGetDatum(tuple));
+        }
+        SRF_RETURN_DONE(funcCtx);
+    }
+    
+    PG_FUNCTION_INFO_V1(mystem_submit);
+    Datum mystem_submit(PG_FUNCTION_ARGS) {
+        text *doc = PG_GETARG_TEXT_PP(0);
+        char *error = nullptr;
+        int64 id = pg_ms::submitDocument(VARDATA_ANY(doc), VARSIZE_ANY_EXHDR(doc), &error);
+        if (error != nullptr) {
+            reportError(error);
+        }
+        
+        PG_RETURN_INT64(id);
+    }
+    
+    PG_FUNCTION_INFO_V1(mystem_fetch);
+    Datum mystem_fetch(PG_FUNCTION_ARGS) {
+        char *error = nullptr;
+        text *result = pg_ms::fetchDocument(PG_GETARG_INT64(0), PG_GETARG_BOOL(1), &error);
+        if (error != nullptr) {
+            reportError(error);
+        }
+        if (result == nullptr) {
+            PG_RETURN_NULL();
+        }
+        
+        PG_RETURN_TEXT_P(result);
+    }
+    
+    PG_FUNCTION_INFO_V1(mystem_cancel);
+    Datum mystem_cancel(PG_FUNCTION_ARGS) {
+        PG_RETURN_BOOL(pg_ms::cancelDocument(PG_GETARG_INT64(0)));
+    }
+    
+    struct convertStreamState_t {
+        int64 m_stream;
+        char *m_portalName;
+        bool m_ownPortal;
+        bool m_exhausted;
+    };
+    
+    // the function is shut down before it has returned every row
+    static void convertStreamShutdown(Datum _arg) {
+        pg_ms::closeStream(((convertStreamState_t *) DatumGetPointer(_arg))->m_stream);
+    }
+    
+    // reads up to _rows documents from the cursor and submits them
+    static void fillConvertStream(convertStreamState_t *_state, long _rows) {
+        if (SPI_connect() != SPI_OK_CONNECT) {
+            elog(ERROR, "MYSTEM: SPI_connect failed");
+        }
+        Portal portal = SPI_cursor_find(_state->m_portalName);
+        if (portal == NULL) {
+            elog(ERROR, "MYSTEM: cursor \"%s\" does not exist", _state->m_portalName);
+        }
+        SPI_cursor_fetch(portal, true, _rows);
+        if (SPI_processed > 0) {
+            if (SPI_tuptable->tupdesc->natts < 1) {
+                elog(ERROR, "MYSTEM: cursor \"%s\" returns no columns", _state->m_portalName);
+            }
+            Oid type = SPI_gettypeid(SPI_tuptable->tupdesc, 1);
+            if (type != TEXTOID && type != VARCHAROID) {
+                elog(ERROR, "MYSTEM: first column of cursor \"%s\" must be text", _state->m_portalName);
+            }
+        }
+        for (uint64 i = 0; i < SPI_processed; ++i) {
+            bool null = false;
+            Datum value = SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1, &null);
+            text *doc = null ? nullptr : DatumGetTextPP(value);
+            char *error = nullptr;
+            pg_ms::streamAdd(_state->m_stream, null ? nullptr : VARDATA_ANY(doc),
+                             null ? 0 : VARSIZE_ANY_EXHDR(doc), null, &error);
+            // a toasted document is detoasted into a copy
+            if (doc != nullptr && (Pointer) doc != DatumGetPointer(value)) {
+                pfree(doc);
+            }
+            if (error != nullptr) {
+                reportError(error);
+            }
+        }
+        _state->m_exhausted = SPI_processed < static_cast<uint64>(_rows);
+        SPI_freetuptable(SPI_tuptable);
+        SPI_finish();
+    }
+    
+    // converts the first column of a query or an open cursor keeping up to window documents in flight,
+    // rows are returned in the order documents complete with their row numbers
+    PG_FUNCTION_INFO_V1(mystem_convert_stream);
+    Datum mystem_convert_stream(PG_FUNCTION_ARGS) {
+        FuncCallContext *funcCtx;
+        if (SRF_IS_FIRSTCALL()) {
+            funcCtx = SRF_FIRSTCALL_INIT();
+            MemoryContext oldCtx = MemoryContextSwitchTo(funcCtx->multi_call_memory_ctx);
+            
+            TupleDesc tupleDesc;
+            if (get_call_result_type(fcinfo, NULL, &tupleDesc) != TYPEFUNC_COMPOSITE) {
+                elog(ERROR, "MYSTEM: return type must be a row type");
+            }
+            funcCtx->tuple_desc = BlessTupleDesc(tupleDesc);
+            
+            int window = PG_GETARG_INT32(1);
+            if (window < 1) {
+                elog(ERROR, "MYSTEM: window must be positive");
+            }
+            convertStreamState_t *state = (convertStreamState_t *) palloc(sizeof(convertStreamState_t));
+            state->m_ownPortal = (get_fn_expr_argtype(fcinfo->flinfo, 0) != REFCURSOROID);
+            state->m_exhausted = false;
+            char *source = text_to_cstring(PG_GETARG_TEXT_PP(0));
+            if (state->m_ownPortal) {
+                if (SPI_connect() != SPI_OK_CONNECT) {
+                    elog(ERROR, "MYSTEM: SPI_connect failed");
+                }
+                Portal portal = SPI_cursor_open_with_args(NULL, source, 0, NULL, NULL, NULL, true, 0);
+                state->m_portalName = MemoryContextStrdup(funcCtx->multi_call_memory_ctx, portal->name);
+                SPI_finish();
+            } else {
+                state->m_portalName = source;
+            }
+            
+            char *error = nullptr;
+            state->m_stream = pg_ms::openStream(window, &error);
+            if (error != nullptr) {
+                reportError(error);
+            }
+            RegisterExprContextCallback(((ReturnSetInfo *) fcinfo->resultinfo)->econtext, convertStreamShutdown,
+                                        PointerGetDatum(state));
+            funcCtx->user_fctx = state;
+            
+            MemoryContextSwitchTo(oldCtx);
+        }
+        
+        funcCtx = SRF_PERCALL_SETUP();
+        convertStreamState_t *state = (convertStreamState_t *) funcCtx->user_fctx;
+        TimestampTz started = GetCurrentTimestamp();
+        for (;;) {
+            int64 ord = 0;
+            text *result = nullptr;
+            char *error = nullptr;
+            int next = pg_ms::streamNext(state->m_stream, &ord, &result, &error);
+            if (error != nullptr) {
+                reportError(error);
+            }
+            if (next > 0) {
+                Datum values[2] = {Int64GetDatum(ord), PointerGetDatum(result)};
+                bool nulls[2] = {false, result == nullptr};
+                HeapTuple tuple = heap_form_tuple(funcCtx->tuple_desc, values, nulls);
+                SRF_RETURN_NEXT(funcCtx, HeapTupleGetDatum(tuple));
+            }
+            
+            long wanted = state->m_exhausted ? 0 : pg_ms::streamWanted(state->m_stream);
+            if (wanted > 0) {
+                fillConvertStream(state, wanted);
+            } else if (next < 0) {
+                break;
+            } else {
+                pg_ms::streamWait(started, &error);
+                if (error != nullptr) {
+                    reportError(error);
+                }
+            }
+        }
+        
+        if (state->m_ownPortal && SPI_connect() == SPI_OK_CONNECT) {
+            Portal portal = SPI_cursor_find(state->m_portalName);
+            if (portal != NULL) {
+                SPI_cursor_close(portal);
+            }
+            SPI_finish();
+        }
+        pg_ms::closeStream(state->m_stream);
+        UnregisterExprContextCallback(((ReturnSetInfo *) fcinfo->resultinfo)->econtext, convertStreamShutdown,
+                                      PointerGetDatum(state));
+        SRF_RETURN_DONE(funcCtx);
+    }
+    
+    PG_FUNCTION_INFO_V1(mystem_cache_stats);
+    Datum mystem_cache_stats(PG_FUNCTION_ARGS) {
+        FuncCallContext *funcCtx;
+        if (SRF_IS_FIRSTCALL()) {
+            funcCtx = SRF_FIRSTCALL_INIT();
+            MemoryContext oldCtx = MemoryContextSwitchTo(funcCtx->multi_call_memory_ctx);
+            
+            TupleDesc tupleDesc;
+            if (get_call_result_type(fcinfo, NULL, &tupleDesc) != TYPEFUNC_COMPOSITE) {
+                elog(ERROR, "MYSTEM: return type must be a row type");
+            }
+            funcCtx->tuple_desc = BlessTupleDesc(tupleDesc);
+            
+            // a disabled cache is reported with zero counters
+            pg_ms::cacheStats_t *stats = (pg_ms::cacheStats_t *) palloc0(sizeof(pg_ms::cacheStats_t) * 2);
+            pg_ms::wordCache_t *wordCache = pg_ms::wordCache_t::attach(pg_ms::wordCacheSize * 1024L);
+            if (wordCache != nullptr) {
+                stats[0] = wordCache->stats();
+            }
+            pg_ms::resultCache_t *resultCache = pg_ms::resultCache_t::attach(pg_ms::resultCacheSize * 1024L);
+            if (resultCache != nullptr) {
+                stats[1] = resultCache->stats();
+            }
+            funcCtx->max_calls = 2;
+            funcCtx->user_fctx = stats;
+            
+            MemoryContextSwitchTo(oldCtx);
+        }
+        
+        funcCtx = SRF_PERCALL_SETUP();
+        if (funcCtx->call_cntr < funcCtx->max_calls) {
+            static const char *caches[] = {"word", "result"};
+            const pg_ms::cacheStats_t &stats = ((pg_ms::cacheStats_t *) funcCtx->user_fctx)[funcCtx->call_cntr];
+            Datum values[5];
+            bool nulls[5] = {false, false, false, false, false};
+            values[0] = CStringGetTextDatum(caches[funcCtx->call_cntr]);
+            values[1] = Int64GetDatum(static_cast<int64>(stats.m_hits));
+            values[2] = Int64GetDatum(static_cast<int64>(stats.m_misses));
+            values[3] = Int64GetDatum(static_cast<int64>(stats.m_insertions));
+            values[4] = Int64GetDatum(static_cast<int64>(stats.m_evictions));
+            HeapTuple tuple = heap_form_tuple(funcCtx->tuple_desc, values, nulls);
+            SRF_RETURN_NEXT(funcCtx, HeapTupleGetDatum(tuple));
+        }
+        SRF_RETURN_DONE(funcCtx);
+    }
+    
+    PG_FUNCTION_INFO_V1(mystem_stat_workers);
+    Datum mystem_stat_workers(PG_FUNCTION_ARGS) {
+        FuncCallContext *funcCtx;
+        if (SRF_IS_FIRSTCALL()) {
+            funcCtx = SRF_FIRSTCALL_INIT();
+            MemoryContext oldCtx = MemoryContextSwitchTo(funcCtx->multi_call_memory_ctx);
+            
+            TupleDesc tupleDesc;
+            if (get_call_result_type(fcinfo, NULL, &tupleDesc) != TYPEFUNC_COMPOSITE) {
+                elog(ERROR, "MYSTEM: return type must be a row type");
+            }
+            funcCtx->tuple_desc = BlessTupleDesc(tupleDesc);
+            
+            pg_ms::mystemStats_t *stats = pg_ms::mystemStats_t::attach();
+            funcCtx->max_calls = (stats == nullptr) ? 0 : stats->workersNo();
+            funcCtx->user_fctx = stats;
+            
+            MemoryContextSwitchTo(oldCtx);
+        }
+        
+        funcCtx = SRF_PERCALL_SETUP();
+        if (funcCtx->call_cntr < funcCtx->max_calls) {
+            pg_ms::mystemStats_t *stats = (pg_ms::mystemStats_t *) funcCtx->user_fctx;
+            pg_ms::mystemStats_t::worker_t &worker = stats->worker(static_cast<uint8_t>(funcCtx->call_cntr));
+            int32 pid = worker.m_pid.load();
+            Datum values[7];
+            bool nulls[7] = {false, pid == 0, false, false, false, false, false};
+            values[0] = Int32GetDatum(funcCtx->call_cntr + 1);
+            values[1] = Int32GetDatum(pid);
+            values[2] = Int64GetDatum(static_cast<int64>(worker.m_documents.load(std::memory_order_relaxed)));
+            values[3] = Int64GetDatum(static_cast<int64>(worker.m_bytes.load(std::memory_order_relaxed)));
+            values[4] = Float8GetDatum(worker.m_busyTime.load(std::memory_order_relaxed) / 1000.0);
+            values[5] = Float8GetDatum(worker.m_idleTime.load(std::memory_order_relaxed) / 1000.0);
+            values[6] = Int64GetDatum(static_cast<int64>(worker.m_restarts.load(std::memory_order_relaxed)));
+            HeapTuple tuple = heap_form_tuple(funcCtx->tuple_desc, values, nulls);
+            SRF_RETURN_NEXT(funcCtx, HeapTupleGetDatum(tuple));
+        }
+        SRF_RETURN_DONE(funcCtx);
+    }
+    
+    PG_FUNCTION_INFO_V1(mystem_stat_queue);
+    Datum mystem_stat_queue(PG_FUNCTION_ARGS) {
+        TupleDesc tupleDesc;
+        if (get_call_result_type(fcinfo, NULL, &tupleDesc) != TYPEFUNC_COMPOSITE) {
+            elog(ERROR, "MYSTEM: return type must be a row type");
+        }
+        tupleDesc = BlessTupleDesc(tupleDesc);
+        
+        pg_ms::inOutQueue_t *inOutQueue = pg_ms::attachBackendQueue();
+        pg_ms::mystemStats_t *stats = pg_ms::mystemStats_t::attach();
+        if (inOutQueue == nullptr || stats == nullptr) {
+            PG_RETURN_NULL();
+        }
+        
+        uint64_t taken = 0;
+        uint64_t waitTime = 0;
+        inOutQueue->waitStats(taken, waitTime);
+        Datum values[3];
+        bool nulls[3] = {false, false, false};
+        values[0] = Int64GetDatum(static_cast<int64>(inOutQueue->pending()));
+        values[1] = Int64GetDatum(static_cast<int64>(taken));
+        values[2] = Int64GetDatum(static_cast<int64>(stats->split()));
+        PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupleDesc, values, nulls)));
+    }
+    
+    PG_FUNCTION_INFO_V1(mystem_stat_latency);
+    Datum mystem_stat_latency(PG_FUNCTION_ARGS) {
+        FuncCallContext *funcCtx;
+        if (SRF_IS_FIRSTCALL()) {
+            funcCtx = SRF_FIRSTCALL_INIT();
+            MemoryContext oldCtx = MemoryContextSwitchTo(funcCtx->multi_call_memory_ctx);
+            
+            TupleDesc tupleDesc;
+            if (get_call_result_type(fcinfo, NULL, &tupleDesc) != TYPEFUNC_COMPOSITE) {
+                elog(ERROR, "MYSTEM: return type must be a row type");
+            }
+            funcCtx->tuple_desc = BlessTupleDesc(tupleDesc);
+            
+            pg_ms::mystemStats_t *stats = pg_ms::mystemStats_t::attach();
+            funcCtx->max_calls = (stats == nullptr) ? 0 :
+                                 pg_ms::mystemStats_t::STAGES_NO * pg_ms::mystemStats_t::buckets;
+            funcCtx->user_fctx = stats;
+            
+            MemoryContextSwitchTo(oldCtx);
+        }
+        
+        // one row per stage and bucket, the last bucket has no upper bound
+        funcCtx = SRF_PERCALL_SETUP();
+        if (funcCtx->call_cntr < funcCtx->max_calls) {
+            pg_ms::mystemStats_t *stats = (pg_ms::mystemStats_t *) funcCtx->user_fctx;
+            uint32_t stage = funcCtx->call_cntr / pg_ms::mystemStats_t::buckets;
+            uint32_t bucket = funcCtx->call_cntr % pg_ms::mystemStats_t::buckets;
+            Datum values[3];
+            bool nulls[3] = {false, bucket == pg_ms::mystemStats_t::buckets - 1, false};
+            values[0] = CStringGetTextDatum(pg_ms::mystemStats_t::stageNames[stage]);
+            values[1] = Int64GetDatum(static_cast<int64>(1) << bucket);
+            values[2] = Int64GetDatum(static_cast<int64>(stats->latency(stage, bucket)));
+            HeapTuple tuple = heap_form_tuple(funcCtx->tuple_desc, values, nulls);
+            SRF_RETURN_NEXT(funcCtx, HeapTupleGetDatum(tuple));
+        }
+        SRF_RETURN_DONE(funcCtx);
+    }
+    
+    PG_FUNCTION_INFO_V1(mystem_stat_reset);
+    Datum mystem_stat_reset(PG_FUNCTION_ARGS) {
+        pg_ms::mystemStats_t *stats = pg_ms::mystemStats_t::attach();
+        if (stats != nullptr) {
+            stats->reset();
+        }
+        PG_RETURN_VOID();
     }
 }
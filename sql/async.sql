@@ -0,0 +1,21 @@
+-- requests are numbered from 1 in every session
+SELECT mystem_submit('Ехал грека через реку');
+SELECT mystem_submit('Видит грека в реке рак');
+SELECT to_json(mystem_fetch(2));
+SELECT to_json(mystem_fetch(1, true));
+-- a fetched request is gone
+SELECT mystem_fetch(1);
+SELECT mystem_submit('Сунул грека руку в реку');
+SELECT mystem_cancel(3);
+SELECT mystem_cancel(3);
+SELECT mystem_fetch(3);
+-- a stream returns every row with its number, a NULL document gives a NULL result
+SELECT ord, to_json(lemmas) FROM mystem_convert_stream('SELECT d FROM (VALUES (''Рак за руку греку цап''), (NULL), (''Ехал грека'')) v(d)', 2) ORDER BY ord;
+BEGIN;
+DECLARE docs CURSOR FOR SELECT d FROM (VALUES ('Мама мыла раму'), ('через реку')) v(d);
+SELECT ord, to_json(lemmas) FROM mystem_convert_stream('docs'::refcursor) ORDER BY ord;
+COMMIT;
+BEGIN;
+DECLARE numbers CURSOR FOR SELECT 1;
+SELECT * FROM mystem_convert_stream('numbers'::refcursor);
+ROLLBACK;
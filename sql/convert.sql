@@ -0,0 +1,10 @@
+CREATE EXTENSION pg_mystem;
+-- the expected output is of bench/fake_mystem, a Cyrillic word's lemma is the word in lower case
+SELECT to_json(mystem_convert('Мама мыла раму'));
+SELECT to_json(mystem_convert('PostgreSQL и Mystem'));
+-- a document without Cyrillic words is converted without mystem
+SELECT to_json(mystem_convert('Hello, World!'));
+SELECT to_json(mystem_convert(''));
+SELECT mystem_convert(NULL::text) IS NULL AS is_null;
+SELECT to_json(mystem_convert(ARRAY['Ехал грека', NULL, 'через реку']));
+SELECT ord, to_json(lemmas) FROM mystem_convert_set(ARRAY['Ехал грека', NULL, 'через реку']);
@@ -0,0 +1,5 @@
+SELECT * FROM ts_token_type('mystem');
+-- words without Cyrillic letters get no lemma from the fake mystem
+SELECT * FROM ts_parse('mystem', 'Ехал Грека через реку в 2024 году');
+SELECT to_tsvector('mystem', 'Ехал Грека через реку в 2024 году');
+SELECT to_tsvector('mystem', 'Мама мыла раму') @@ to_tsquery('mystem', 'Раму') AS found;
@@ -0,0 +1,9 @@
+-- a document of several lines is answered by mystem line by line, every line break becomes a blank;
+-- the output is the same with pg_mystem.protocol = json (make installcheck) and text (make installcheck-text)
+SELECT to_json(mystem_convert(E'Мама мыла\nраму'));
+SELECT to_json(mystem_convert(E'Ехал грека\n\nчерез реку'));
+SELECT to_json(mystem_convert(E'Hello\nWorld'));
+-- braces of the document are not lemmas, mystem puts a lemma only after a word with Cyrillic letters
+SELECT to_json(mystem_convert('Мама foo{bar} id{42} мыла{x} раму'));
+SELECT to_json(mystem_convert(ARRAY[E'Мама\nмыла', E'раму\n']));
+SELECT * FROM ts_parse('mystem', E'Ехал грека\nчерез реку');
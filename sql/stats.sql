@@ -0,0 +1,17 @@
+SELECT mystem_stat_reset();
+SELECT count(*) > 0 AS workers, sum(documents) AS documents FROM mystem_stat_workers();
+SELECT queue_depth, split_documents FROM mystem_stat_queue();
+SELECT stage, sum(count) AS count FROM mystem_stat_latency() GROUP BY stage ORDER BY stage;
+-- a worker counts the document before it posts the result
+SELECT to_json(mystem_convert('Мама мыла раму'));
+SELECT sum(documents) AS documents, sum(bytes) > 0 AS bytes FROM mystem_stat_workers();
+SELECT count(*) AS buckets, sum(count) AS count FROM mystem_stat_latency() WHERE stage = 'mystem' AND count > 0;
+SELECT count(*) > 0 AS workers FROM pg_stat_mystem;
+SELECT cache FROM mystem_cache_stats();
+-- the counters are readable by everyone, reset is for superusers
+CREATE ROLE regress_mystem_reader;
+SET ROLE regress_mystem_reader;
+SELECT count(*) > 0 AS stages FROM pg_stat_mystem_latency;
+SELECT mystem_stat_reset();
+RESET ROLE;
+DROP ROLE regress_mystem_reader;